@@ -12,4 +12,12 @@ struct Vec3 {
         float z;
 };
 
+/* axis-aligned rectangle */
+struct Rect {
+        float minX;
+        float minY;
+        float maxX;
+        float maxY;
+};
+
 #endif
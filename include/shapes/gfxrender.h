@@ -1,12 +1,42 @@
+#ifndef SHAPES_GFXRENDER_H_INCLUDED
+#define SHAPES_GFXRENDER_H_INCLUDED
+
+#include <stdint.h>
+
 enum {
         SHADER_VERTEX,
         SHADER_FRAGMENT,
 };
 
+enum {
+        TEXTUREFORMAT_R8,
+        TEXTUREFORMAT_RGBA8,
+        TEXTUREFORMAT_RGBA8_SRGB,
+        TEXTUREFORMAT_RGBA16F,
+};
+
+enum {
+        BLEND_NONE,
+        BLEND_ALPHA,
+        BLEND_ALPHA_TO_LAYER,  // produce premultiplied color, for later compositing
+        BLEND_PREMULTIPLIED,  // composite a layer made with BLEND_ALPHA_TO_LAYER
+        BLEND_ADDITIVE,  // add up the fragments, e.g. to count them in a float target
+};
+
+/* Depth testing passes fragments that are nearer (less) than the depth
+ * buffer. Needs a depth buffer, see set_GfxFBO_depth_size(). */
+enum {
+        DEPTH_NONE,
+        DEPTH_TEST,
+        DEPTH_TEST_AND_WRITE,
+};
+
 typedef int GfxVBO;
 typedef int GfxVAO;
 typedef int GfxShader;
 typedef int GfxProgram;
+typedef int GfxTexture;
+typedef int GfxFBO;
 typedef int UniformLocation;
 typedef int AttributeLocation;
 
@@ -14,20 +44,70 @@ GfxVBO create_GfxVBO(void);
 GfxVAO create_GfxVAO(void);
 GfxShader create_GfxShader(int shaderKind, const char *shaderName);
 GfxProgram create_GfxProgram(const char *programName);
+GfxTexture create_GfxTexture(void);
+GfxFBO create_GfxFBO(void);
 UniformLocation get_uniform_location(GfxProgram gfxProgram, const char *uniformName);
 AttributeLocation get_attribute_location(GfxProgram gfxProgram, const char *attribName);
 void set_GfxVBO_data(GfxVBO gfxVBO, const void *data, uint64_t size);
+void set_GfxVBO_subdata(GfxVBO gfxVBO, uint64_t offset, const void *data, uint64_t size);
+GfxVBO get_stream_GfxVBO(void);
+uint64_t write_to_stream(const void *data, uint64_t size, int alignment);
+void set_program_uniform_1i(GfxProgram gfxProgram, UniformLocation uniformLocation, int x);
 void set_program_uniform_1f(GfxProgram gfxProgram, UniformLocation uniformLocation, float x);
 void set_program_uniform_2f(GfxProgram gfxProgram, UniformLocation uniformLocation, float x, float y);
 void set_program_uniform_3f(GfxProgram gfxProgram, UniformLocation uniformLocation, float x, float y, float z);
+void set_program_uniform_4f(GfxProgram gfxProgram, UniformLocation uniformLocation, float x, float y, float z, float w);
 void set_program_uniform_mat2f(GfxProgram gfxProgram, UniformLocation uniformLocation, float *fourFloats);
 void set_program_uniform_mat3f(GfxProgram gfxProgram, UniformLocation uniformLocation, float *nineFloats);
 void set_program_uniform_mat4f(GfxProgram gfxProgram, UniformLocation uniformLocation, float *sixteenFloats);
 void set_attribute_pointer(GfxVAO gfxVaoOfProgram, AttributeLocation attribLocation, GfxVBO gfxVBO, int numFloats, int stride, int offset);
+void set_instanced_attribute_pointer(GfxVAO gfxVaoOfProgram, AttributeLocation attribLocation, GfxVBO gfxVBO, int numFloats, int stride, int offset);
 void set_GfxShader_source(GfxShader gfxShader, const char *source);
+void set_GfxShader_sources(GfxShader gfxShader, int numSources, const char *const *sources);
 void compile_GfxShader(GfxShader gfxShader);
 void add_GfxShader_to_GfxProgram(GfxShader gfxShader, GfxProgram gfxProgram);
+void bind_attribute_location(GfxProgram gfxProgram, AttributeLocation attribLocation, const char *attribName);  // before linking
 void link_GfxProgram(GfxProgram gfxProgram);
+void set_GfxTexture_size(GfxTexture gfxTexture, int textureFormat, int width, int height);
+void set_GfxTexture_data(GfxTexture gfxTexture, int textureFormat, int width, int height, const void *data);
+void set_GfxTexture_subdata(GfxTexture gfxTexture, int textureFormat, int x, int y, int width, int height, const void *data);
+void bind_GfxTexture(int textureUnit, GfxTexture gfxTexture);
+void attach_GfxTexture_to_GfxFBO(GfxTexture gfxTexture, GfxFBO gfxFBO);
+void set_GfxFBO_depth_size(GfxFBO gfxFBO, int width, int height);
+void bind_GfxFBO(GfxFBO gfxFBO);
+void bind_window_framebuffer(void);
+void set_viewport(int x, int y, int width, int height);
+void set_blending(int blendMode);
+void set_depth_mode(int depthMode);
+void set_scissor_rect(int x, int y, int width, int height);
+void unset_scissor_rect(void);
 void clear_current_buffer(void);
+void clear_current_buffer_transparent(void);
+void clear_current_depth_buffer(void);
+void read_current_buffer_float(int x, int y, int width, int height, float *rgbaOut);
 void render_with_GfxProgram(GfxProgram gfxProgram, GfxVAO gfxVaoOfProgram, int first, int count);
+void render_instanced_with_GfxProgram(GfxProgram gfxProgram, GfxVAO gfxVaoOfProgram, int first, int count, int numInstances);
+
+/* Lower-level interface: bind state once, then draw many times. The
+ * set_uniform_*() functions apply to the program that is in use. Pass -1 to
+ * unbind. */
+void use_GfxProgram(GfxProgram gfxProgram);
+void bind_GfxVAO(GfxVAO gfxVAO);
+void set_uniform_1i(UniformLocation uniformLocation, int x);
+void set_uniform_1f(UniformLocation uniformLocation, float x);
+void set_uniform_4f(UniformLocation uniformLocation, float x, float y, float z, float w);
+void set_uniform_mat3f(UniformLocation uniformLocation, const float *nineFloats);
+void draw_triangles(int first, int count);
+void draw_triangles_instanced(int first, int count, int numInstances, int baseInstance);
+/* Measure the GPU time of the commands between begin_gpu_timer() and
+ * end_gpu_timer(). Results come in later, in order, without waiting for the
+ * GPU: poll_gpu_timer() returns 1 and the time of the oldest measurement
+ * once it is ready. begin_gpu_timer() returns 0 if no measurement was started
+ * because too many are in flight. Not available under emscripten, where
+ * nothing gets measured. */
+int begin_gpu_timer(void);
+void end_gpu_timer(void);
+int poll_gpu_timer(double *outSeconds);
 void setup_gfx(void);
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef SHAPES_RENDERCOMMANDS_H_INCLUDED
+#define SHAPES_RENDERCOMMANDS_H_INCLUDED
+
+#include <shapes/defs.h>
+#include <shapes/gfxrender.h>
+#include <stdint.h>
+
+/*
+ * A list of recorded draw commands. Recording only fills in memory (no GL
+ * calls), so it can happen on any thread, as long as each thread records
+ * into its own list. Draws name their program by a key that the caller
+ * chooses, and uniforms by their index in the program's uniform locations.
+ * The program and the locations are looked up with the list's
+ * resolveProgram function when the list is submitted, which must happen on
+ * the GL thread. That function may compile the program the first time it is
+ * asked for it. Before submission, the commands are sorted by a 64-bit key
+ * made of
+ *
+ *   layer (8 bits) | blend mode (4 bits) | program key (12 bits) | VAO (16 bits) | sequence (24 bits)
+ *
+ * so commands in lower layers are drawn first, and within a layer, commands
+ * that use the same state are grouped together. The sequence number keeps
+ * the recording order otherwise. Submission binds state only when it changes.
+ *
+ * Note that uniform values and uploads are stored by value or by pointer,
+ * respectively. Uploaded data must stay valid until the list is submitted.
+ * Uploads go to the stream buffer (see get_stream_GfxVBO()), and the base
+ * instance of the draw is offset to where the data landed, so the VAO's
+ * instanced attributes should source from the stream buffer.
+ */
+
+enum {
+        RENDERUNIFORM_1I,
+        RENDERUNIFORM_1F,
+        RENDERUNIFORM_4F,
+        RENDERUNIFORM_MAT3F,
+};
+
+/* Returns the program for a program key, and the locations of its
+ * uniforms, indexed like the uniforms that are recorded for it */
+typedef GfxProgram RESOLVE_PROGRAM_FUNCTION(int programKey, const UniformLocation **outUniformLocations);
+
+struct RenderUniform {
+        int renderuniformKind;
+        int uniformIndex;
+        int intValue;
+        float floatValues[9];
+};
+
+struct RenderCommand {
+        uint64_t sortKey;
+        int programKey;
+        GfxVAO gfxVAO;
+        int blendMode;
+        int depthMode;
+        GfxTexture gfxTexture;  // bound to texture unit 0, or -1
+        const void *uploadData;  // written to the stream buffer before the draw, or NULL
+        uint64_t uploadSize;
+        int uploadStride;
+        int firstUniform;
+        int numUniforms;
+        int first;
+        int count;
+        int numInstances;  // 0 for a non-instanced draw
+        int baseInstance;
+};
+
+struct RenderCommandList {
+        struct RenderCommand *commands;
+        struct RenderCommand *sortedCommands;  // scratch space for sorting
+        int numCommands;
+        int commandsCapacity;
+        struct RenderUniform *uniforms;
+        int numUniforms;
+        int uniformsCapacity;
+        RESOLVE_PROGRAM_FUNCTION *resolveProgram;  // set by the owner of the list
+};
+
+void reset_RenderCommandList(struct RenderCommandList *list);
+void record_draw(struct RenderCommandList *list, int layer,
+        int programKey, GfxVAO gfxVAO, int blendMode,
+        int first, int count, int numInstances);
+
+/* These add to the last recorded draw */
+void record_upload(struct RenderCommandList *list, const void *data, uint64_t size, int stride);
+void record_base_instance(struct RenderCommandList *list, int baseInstance);
+void record_texture(struct RenderCommandList *list, GfxTexture gfxTexture);
+void record_depth_mode(struct RenderCommandList *list, int depthMode);
+void record_uniform_1i(struct RenderCommandList *list, int uniformIndex, int x);
+void record_uniform_1f(struct RenderCommandList *list, int uniformIndex, float x);
+void record_uniform_4f(struct RenderCommandList *list, int uniformIndex, float x, float y, float z, float w);
+void record_uniform_mat3f(struct RenderCommandList *list, int uniformIndex, const float *nineFloats);
+
+void sort_RenderCommandList(struct RenderCommandList *list);
+/* Sorts the list, submits it, and resets it. Leaves no program or VAO bound,
+ * the blend mode at BLEND_ALPHA, and the depth mode at DEPTH_NONE */
+void submit_RenderCommandList(struct RenderCommandList *list);
+
+#endif
@@ -12,6 +12,7 @@
 enum {
         OBJECT_CIRCLE,
         OBJECT_ELLIPSE,
+        OBJECT_ROUNDRECT,
 };
 
 typedef int Object;
@@ -28,11 +29,29 @@ struct Ellipse {
         float radius;
 };
 
+/* An outline of a rectangle with rounded corners. The outline is a band of
+ * the given thickness inside the edge. If the thickness is at least the
+ * smaller half size, the rectangle is filled. */
+struct RoundRect {
+        float centerX;
+        float centerY;
+        float halfWidth;
+        float halfHeight;
+        float cornerRadius;  // at most the smaller half size
+        float thickness;
+};
+
+/* The stroke is an outline that is drawn inside the edge of the shape, so
+ * it doesn't change the bounds. A width of 0 means no stroke. */
 struct Object {
         int objectKind;
+        float strokeWidth;  // in world units
+        float strokeColor[3];
+        char *label;  // drawn at the position of the object, or NULL
         union {
                 struct Circle tCircle;
                 struct Ellipse tEllipse;
+                struct RoundRect tRoundRect;
         } data;
 };
 
@@ -53,12 +72,85 @@ DATA int isHoveringObject;
 DATA int isDraggingObject;
 DATA int activeObject;
 
+/* If set, the spatial index that culling and hit testing go through gets
+ * re-sorted along a Z-order (Morton) curve on a worker thread once enough of
+ * the scene changed (see compact_objects()), so that objects that are close
+ * in space are close in memory, too. The objects array and the Object values stay as they are:
+ * an Object is also the position of the object in the drawing order. */
+DATA int isCompactionEnabled;
+
+/* If set, circles are lit by a lookup in a precomputed lighting texture
+ * instead of evaluating the lights for each pixel. Toggled with the L key. */
+DATA int isMatcapEnabled;
+
+/* If set, the renderer shows how many fragments each pixel gets instead of
+ * the scene, and logs statistics about it. Toggled with the O key. */
+DATA int isOverdrawHeatmapEnabled;
+
+/* If set, the scene gets rendered at a lower resolution when it takes too
+ * long on the GPU, and upscaled to the window. Toggled with the R key. */
+DATA int isDynamicResolutionEnabled;
+
+/* Result of the last call to cull_objects(): the objects whose bounds
+ * intersect the given rectangle, in increasing order. draw_shapes() culls
+ * against the visible world rectangle each frame, and other passes can reuse
+ * the result. */
+DATA Object *visibleObjects;
+DATA int numVisibleObjects;
+DATA struct Rect visibleWorldRect;
+
+/* The objects that change while activeObject is being dragged: the active
+ * object itself and, if it is a circle, all ellipses that have it as a focus.
+ * In increasing order. Collected when the drag starts. */
+DATA Object *draggedObjects;
+DATA int numDraggedObjects;
+
+/* World-space rectangles where the picture changed since the last frame,
+ * because objects changed or moved (both old and new bounds are included).
+ * If isDamagedEverywhere is set, the rectangles are meaningless and
+ * everything needs to be redrawn. The renderer resets the damage after it
+ * drew a frame. */
+enum {
+        MAX_DAMAGE_RECTS = 16,
+};
+
+DATA struct Rect damageRects[MAX_DAMAGE_RECTS];
+DATA int numDamageRects;
+DATA int isDamagedEverywhere;
+
+/* Objects whose appearance changed since the renderer last looked, without
+ * duplicates. sceneStructureVersion changes whenever objects get added, so
+ * anything that is indexed by Object must be extended. */
+DATA Object *dirtyObjects;
+DATA int numDirtyObjects;
+DATA int sceneStructureVersion;
+
+/* changes whenever objects get added, moved, or restyled, but not when only
+ * the hover highlight changes */
+DATA int sceneContentVersion;
+
+/* changes whenever the text of a label changes */
+DATA int labelVersion;
+
 void setup_shapesrender(void);
 void draw_shapes(void);
 
 void setup_shapes(void);
 Object add_circle(float x, float y, float radius);
 Object add_ellipse(Object centerCircle0, Object centerCircle1, float radius);
+Object add_roundrect(float x, float y, float halfWidth, float halfHeight, float cornerRadius, float thickness);
+void set_object_stroke(Object obj, float width, float r, float g, float b);
+void set_object_label(Object obj, const char *text);
 void update_shapes(struct Input input);
+void compact_objects(void);
+void get_object_position(Object obj, float *outX, float *outY);
+void get_object_bounds(Object obj, struct Rect *outRect);
+void get_scene_bounds(struct Rect *outRect);
+int test_rects_overlap(const struct Rect *a, const struct Rect *b);
+void cull_objects(const struct Rect *rect);
+void add_damage_rect(const struct Rect *rect);
+void damage_everything(void);
+void reset_damage(void);
+void reset_dirty_objects(void);
 
 #endif
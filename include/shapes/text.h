@@ -0,0 +1,47 @@
+#ifndef SHAPES_TEXT_H_INCLUDED
+#define SHAPES_TEXT_H_INCLUDED
+
+#include <shapes/defs.h>
+#include <shapes/gfxrender.h>
+
+/*
+ * Text rendering with FreeType. Glyphs are stored as signed distance fields
+ * in a single channel atlas texture: 0.5 is on the outline, and larger values
+ * are inside. They are generated from the glyph outlines at a single size, and
+ * can be drawn sharp at any size by thresholding at 0.5. The printable ASCII
+ * glyphs are generated at startup, others when they are first needed.
+ *
+ * The atlas is packed in shelves (rows of glyphs of about the same height).
+ * When the atlas is full, the least recently used shelf gets evicted.
+ *
+ * The layout of a string (glyph indices, advances and kerning) is cached, so
+ * laying out the same text again only looks up the glyphs in the atlas.
+ *
+ * If FreeType or a font file isn't available, setup_text() logs a message and
+ * layout_text() produces no glyphs.
+ */
+
+/* Lengths are in the unit of the font size that was passed to layout_text().
+ * The quads include a margin around the glyph where the distance field
+ * fades out, so that the edge can be smoothed. */
+struct GlyphQuad {
+        float offset[2];  // of the lower left corner from the pen origin
+        float size[2];
+        float texRect[4];  // texture coordinates of the lower left and the upper right corner
+};
+
+void setup_text(void);
+int is_text_available(void);
+GfxTexture get_text_atlas_texture(void);
+
+/* Glyphs that get laid out between begin_text_batch() calls stay in the
+ * atlas until the next call, so their quads remain valid. */
+void begin_text_batch(void);
+
+/* Lay out a UTF-8 string on a baseline that starts at the pen origin. The
+ * font size is the size of the em square, in any unit. The quads stay valid
+ * until the next call. Glyphs that don't fit in the atlas are left out.
+ * Returns the number of quads. */
+int layout_text(const char *text, float fontSize, const struct GlyphQuad **outQuads, float *outWidth);
+
+#endif
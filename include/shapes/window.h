@@ -171,6 +171,19 @@ struct Input {
 
 DATA int shouldWindowClose;
 
+/* wait_for_events() only blocks if no redraw is needed. While
+ * areTimeticksNeeded is set, it doesn't block longer than a tick interval
+ * and generates an INPUT_TIMETICK whenever an interval has passed. The
+ * shapes set it while a compaction of the spatial index is running on a
+ * worker, so that the result gets picked up while the window is idle. */
+DATA int isRedrawNeeded;
+DATA int areTimeticksNeeded;
+
+/* If not 0, wait_for_events() doesn't block past this time (see
+ * get_time_in_seconds()) and sets isRedrawNeeded once it has come. Use
+ * schedule_redraw() to set it. */
+DATA double scheduledRedrawTime;
+
 DATA int windowWidthInPixels;
 DATA int windowHeightInPixels;
 
@@ -178,11 +191,13 @@ DATA int windowHeightInPixels;
 void enqueue_input(const struct Input *input);
 int look_input(struct Input *input);
 void consume_input(void);
+void schedule_redraw(double time);
 
 /* implemented in backend-specific file (window-XXX.c) */
 void setup_window(void);
 void teardown_window(void);
 void wait_for_events(void);
+double get_time_in_seconds(void);
 void swap_buffers(void);
 void enter_windowing_mode(void);
 void enter_fullscreen_mode(void);
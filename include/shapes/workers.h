@@ -0,0 +1,29 @@
+#ifndef SHAPES_WORKERS_H_INCLUDED
+#define SHAPES_WORKERS_H_INCLUDED
+
+#include <shapes/defs.h>
+
+/*
+ * A simple pool of worker threads. run_parallel() splits a task into a number
+ * of jobs, runs them on the pool (the calling thread helps out) and returns
+ * when all jobs have finished. On platforms without thread support, the jobs
+ * are simply run one after the other on the calling thread.
+ *
+ * start_background_job() hands a single job to one of the workers and returns
+ * right away. Poll is_background_job_done() to find out when it has finished.
+ * There can be only one background job at a time. Without worker threads, the
+ * job runs on the calling thread before start_background_job() returns.
+ */
+
+typedef void WORKER_FUNCTION(void *arg, int jobIndex, int numJobs);
+
+/* number of threads that can work on a task concurrently, including the
+ * calling thread. Always at least 1. */
+DATA int numWorkerThreads;
+
+void setup_workers(void);
+void run_parallel(WORKER_FUNCTION *func, void *arg, int numJobs);
+void start_background_job(WORKER_FUNCTION *func, void *arg);
+int is_background_job_done(void);
+
+#endif
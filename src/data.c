@@ -1,3 +1,4 @@
 #define SHAPES_IMPLEMENT_DATA
 #include <shapes/window.h>
 #include <shapes/shapes.h>
+#include <shapes/workers.h>
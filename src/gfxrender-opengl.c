@@ -16,6 +16,7 @@
 #endif
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 struct OpenGLInitInfo {
         void(**funcptr)(void);
@@ -26,8 +27,21 @@ struct GfxVBOInfo {
         GLuint vboId;
 };
 
+/* We remember the instanced attributes of each VAO, so we can emulate a base
+ * instance (which GL 3.3 and GLES 3 don't have) by offsetting them. */
+struct InstancedAttributeInfo {
+        AttributeLocation attribLocation;
+        GfxVBO gfxVBO;
+        int numFloats;
+        int stride;
+        int offset;
+};
+
 struct GfxVAOInfo {
         GLuint vaoId;
+        struct InstancedAttributeInfo *instancedAttributes;
+        int numInstancedAttributes;
+        int currentBaseInstance;
 };
 
 struct GfxShaderInfo {
@@ -40,6 +54,19 @@ struct GfxProgramInfo {
         const char *programName;
 };
 
+struct GfxTextureInfo {
+        GLuint textureId;
+        int width;
+        int height;
+};
+
+struct GfxFBOInfo {
+        GLuint fboId;
+        GLuint depthRenderbufferId;  // 0 if there is no depth buffer
+        int width;
+        int height;
+};
+
 #ifndef __EMSCRIPTEN__
 /* Define function pointers for all OpenGL extensions that we want to load */
 #define MAKE(tp, name) static tp name;
@@ -58,11 +85,53 @@ static struct GfxVBOInfo *gfxVBOInfo;
 static struct GfxVAOInfo *gfxVAOInfo;
 static struct GfxShaderInfo *gfxShaderInfo;
 static struct GfxProgramInfo *gfxProgramInfo;
+static struct GfxTextureInfo *gfxTextureInfo;
+static struct GfxFBOInfo *gfxFBOInfo;
 
 static int numGfxVBOs;
 static int numGfxVAOs;
 static int numGfxShaders;
 static int numGfxPrograms;
+static int numGfxTextures;
+static int numGfxFBOs;
+
+static GfxVAO boundGfxVAO = -1;
+
+/* The stream buffer is a ring that is divided into sections. When writing
+ * moves on to the next section, a fence is put after the draws that used the
+ * current one, and before a section is reused, we wait for its fence. With
+ * ARB_buffer_storage the buffer is mapped once, persistently, otherwise each
+ * write maps the range unsynchronized. WebGL can't map buffers at all, so
+ * there we fall back to glBufferSubData(). */
+enum {
+        NUM_STREAM_SECTIONS = 4,
+};
+
+static const uint64_t initialStreamSize = 4 << 20;
+
+static GfxVBO streamVBO;
+static uint64_t streamSize;
+static uint64_t streamHead;
+static int streamSection;
+static int isStreamPersistent;
+static char *streamMapping;
+#ifndef __EMSCRIPTEN__
+static GLsync streamFences[NUM_STREAM_SECTIONS];
+static PFNGLBUFFERSTORAGEPROC glBufferStorage;
+#endif
+
+/* Timer queries for begin_gpu_timer(). The queries from gpuTimerTail to
+ * gpuTimerHead (modulo NUM_GPU_TIMER_QUERIES) are in flight. */
+enum {
+        NUM_GPU_TIMER_QUERIES = 4,
+};
+
+#ifndef __EMSCRIPTEN__
+static GLuint gpuTimerQueries[NUM_GPU_TIMER_QUERIES];
+static int gpuTimerHead;
+static int gpuTimerTail;
+static int isGpuTimerRunning;
+#endif
 
 static const char *gl_error_string(int errorGl)
 {
@@ -110,6 +179,9 @@ GfxVAO create_GfxVAO(void)
         GfxVAO gfxVao = numGfxVAOs++;
         REALLOC_MEMORY(&gfxVAOInfo, numGfxVAOs);
         gfxVAOInfo[gfxVao].vaoId = vaoId;
+        gfxVAOInfo[gfxVao].instancedAttributes = NULL;
+        gfxVAOInfo[gfxVao].numInstancedAttributes = 0;
+        gfxVAOInfo[gfxVao].currentBaseInstance = 0;
         CHECK_GL_ERRORS();
         return gfxVao;
 }
@@ -145,6 +217,39 @@ GfxProgram create_GfxProgram(const char *programName)
         return gfxProgram;
 }
 
+GfxTexture create_GfxTexture(void)
+{
+        GLuint textureId;
+        glGenTextures(1, &textureId);
+        GfxTexture gfxTexture = numGfxTextures++;
+        REALLOC_MEMORY(&gfxTextureInfo, numGfxTextures);
+        gfxTextureInfo[gfxTexture].textureId = textureId;
+        gfxTextureInfo[gfxTexture].width = 0;
+        gfxTextureInfo[gfxTexture].height = 0;
+        glBindTexture(GL_TEXTURE_2D, textureId);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        CHECK_GL_ERRORS();
+        return gfxTexture;
+}
+
+GfxFBO create_GfxFBO(void)
+{
+        GLuint fboId;
+        glGenFramebuffers(1, &fboId);
+        GfxFBO gfxFBO = numGfxFBOs++;
+        REALLOC_MEMORY(&gfxFBOInfo, numGfxFBOs);
+        gfxFBOInfo[gfxFBO].fboId = fboId;
+        gfxFBOInfo[gfxFBO].depthRenderbufferId = 0;
+        gfxFBOInfo[gfxFBO].width = 0;
+        gfxFBOInfo[gfxFBO].height = 0;
+        CHECK_GL_ERRORS();
+        return gfxFBO;
+}
+
 UniformLocation get_uniform_location(GfxProgram gfxProgram, const char *uniformName)
 {
         GLuint programId = gfxProgramInfo[gfxProgram].programId;
@@ -174,6 +279,26 @@ void set_GfxVBO_data(GfxVBO gfxVBO, const void *data, uint64_t size)
         CHECK_GL_ERRORS();
 }
 
+/* Overwrite part of the buffer. It must have been made big enough by
+ * set_GfxVBO_data() */
+void set_GfxVBO_subdata(GfxVBO gfxVBO, uint64_t offset, const void *data, uint64_t size)
+{
+        GLuint vboId = gfxVBOInfo[gfxVBO].vboId;
+        glBindBuffer(GL_ARRAY_BUFFER, vboId);
+        glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        CHECK_GL_ERRORS();
+}
+
+void set_program_uniform_1i(GfxProgram gfxProgram, UniformLocation uniformLocation, int x)
+{
+        GLuint programId = gfxProgramInfo[gfxProgram].programId;
+        glUseProgram(programId);
+        glUniform1i(uniformLocation, x);
+        glUseProgram(0);
+        CHECK_GL_ERRORS();
+}
+
 void set_program_uniform_1f(GfxProgram gfxProgram, UniformLocation uniformLocation, float x)
 {
         GLuint programId = gfxProgramInfo[gfxProgram].programId;
@@ -201,6 +326,15 @@ void set_program_uniform_3f(GfxProgram gfxProgram, UniformLocation uniformLocati
         CHECK_GL_ERRORS();
 }
 
+void set_program_uniform_4f(GfxProgram gfxProgram, UniformLocation uniformLocation, float x, float y, float z, float w)
+{
+        GLuint programId = gfxProgramInfo[gfxProgram].programId;
+        glUseProgram(programId);
+        glUniform4f(uniformLocation, x, y, z, w);
+        glUseProgram(0);
+        CHECK_GL_ERRORS();
+}
+
 void set_program_uniform_mat2f(GfxProgram gfxProgram, UniformLocation uniformLocation, float *fourFloats)
 {
         GLuint programId = gfxProgramInfo[gfxProgram].programId;
@@ -243,6 +377,28 @@ void set_attribute_pointer(GfxVAO gfxVAO, AttributeLocation attribLocation, GfxV
         CHECK_GL_ERRORS();
 }
 
+/* like set_attribute_pointer(), but the attribute advances once per instance
+ * instead of once per vertex */
+void set_instanced_attribute_pointer(GfxVAO gfxVAO, AttributeLocation attribLocation, GfxVBO gfxVBO, int numFloats, int stride, int offset)
+{
+        set_attribute_pointer(gfxVAO, attribLocation, gfxVBO, numFloats, stride, offset);
+        GLuint vaoId = gfxVAOInfo[gfxVAO].vaoId;
+        glBindVertexArray(vaoId);
+        glVertexAttribDivisor(attribLocation, 1);
+        glBindVertexArray(0);
+        CHECK_GL_ERRORS();
+
+        struct GfxVAOInfo *info = &gfxVAOInfo[gfxVAO];
+        int i = info->numInstancedAttributes++;
+        REALLOC_MEMORY(&info->instancedAttributes, info->numInstancedAttributes);
+        info->instancedAttributes[i].attribLocation = attribLocation;
+        info->instancedAttributes[i].gfxVBO = gfxVBO;
+        info->instancedAttributes[i].numFloats = numFloats;
+        info->instancedAttributes[i].stride = stride;
+        info->instancedAttributes[i].offset = offset;
+        info->currentBaseInstance = 0;
+}
+
 void set_GfxShader_source(GfxShader gfxShader, const char *source)
 {
         CHECK_GL_ERRORS();
@@ -251,6 +407,13 @@ void set_GfxShader_source(GfxShader gfxShader, const char *source)
         CHECK_GL_ERRORS();
 }
 
+void set_GfxShader_sources(GfxShader gfxShader, int numSources, const char *const *sources)
+{
+        GLuint shaderId = gfxShaderInfo[gfxShader].shaderId;
+        glShaderSource(shaderId, numSources, (const GLchar *const *) sources, NULL);
+        CHECK_GL_ERRORS();
+}
+
 void compile_GfxShader(GfxShader gfxShader)
 {
         GLuint shaderId = gfxShaderInfo[gfxShader].shaderId;
@@ -274,6 +437,12 @@ void add_GfxShader_to_GfxProgram(GfxShader gfxShader, GfxProgram gfxProgram)
         CHECK_GL_ERRORS();
 }
 
+void bind_attribute_location(GfxProgram gfxProgram, AttributeLocation attribLocation, const char *attribName)
+{
+        glBindAttribLocation(gfxProgramInfo[gfxProgram].programId, attribLocation, attribName);
+        CHECK_GL_ERRORS();
+}
+
 void link_GfxProgram(GfxProgram gfxProgram)
 {
         GLuint programId = gfxProgramInfo[gfxProgram].programId;
@@ -290,6 +459,192 @@ void link_GfxProgram(GfxProgram gfxProgram)
         CHECK_GL_ERRORS();
 }
 
+void set_GfxTexture_size(GfxTexture gfxTexture, int textureFormat, int width, int height)
+{
+        set_GfxTexture_data(gfxTexture, textureFormat, width, height, NULL);
+}
+
+static void get_texture_format(int textureFormat, GLint *internalFormat, GLenum *format, GLenum *type)
+{
+        if (textureFormat == TEXTUREFORMAT_R8) {
+                *internalFormat = GL_R8;
+                *format = GL_RED;
+                *type = GL_UNSIGNED_BYTE;
+        }
+        else if (textureFormat == TEXTUREFORMAT_RGBA8) {
+                *internalFormat = GL_RGBA8;
+                *format = GL_RGBA;
+                *type = GL_UNSIGNED_BYTE;
+        }
+        else if (textureFormat == TEXTUREFORMAT_RGBA8_SRGB) {
+                *internalFormat = GL_SRGB8_ALPHA8;
+                *format = GL_RGBA;
+                *type = GL_UNSIGNED_BYTE;
+        }
+        else if (textureFormat == TEXTUREFORMAT_RGBA16F) {
+                *internalFormat = GL_RGBA16F;
+                *format = GL_RGBA;
+                *type = GL_HALF_FLOAT;
+        }
+        else
+                fatalf("Invalid value!\n");
+}
+
+void set_GfxTexture_data(GfxTexture gfxTexture, int textureFormat, int width, int height, const void *data)
+{
+        GLint internalFormat;
+        GLenum format;
+        GLenum type;
+        get_texture_format(textureFormat, &internalFormat, &format, &type);
+        glBindTexture(GL_TEXTURE_2D, gfxTextureInfo[gfxTexture].textureId);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, data);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        gfxTextureInfo[gfxTexture].width = width;
+        gfxTextureInfo[gfxTexture].height = height;
+        CHECK_GL_ERRORS();
+}
+
+void set_GfxTexture_subdata(GfxTexture gfxTexture, int textureFormat, int x, int y, int width, int height, const void *data)
+{
+        GLint internalFormat;
+        GLenum format;
+        GLenum type;
+        get_texture_format(textureFormat, &internalFormat, &format, &type);
+        // rows are tightly packed, which matters for single channel formats
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glBindTexture(GL_TEXTURE_2D, gfxTextureInfo[gfxTexture].textureId);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, format, type, data);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        CHECK_GL_ERRORS();
+}
+
+void bind_GfxTexture(int textureUnit, GfxTexture gfxTexture)
+{
+        glActiveTexture(GL_TEXTURE0 + textureUnit);
+        glBindTexture(GL_TEXTURE_2D, gfxTextureInfo[gfxTexture].textureId);
+        glActiveTexture(GL_TEXTURE0);
+        CHECK_GL_ERRORS();
+}
+
+/* The texture must have its size set already. If the texture gets resized
+ * later, it has to be attached again. */
+void attach_GfxTexture_to_GfxFBO(GfxTexture gfxTexture, GfxFBO gfxFBO)
+{
+        glBindFramebuffer(GL_FRAMEBUFFER, gfxFBOInfo[gfxFBO].fboId);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                gfxTextureInfo[gfxTexture].textureId, 0);
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        if (status != GL_FRAMEBUFFER_COMPLETE)
+                fatalf("Framebuffer is incomplete (status 0x%x)\n", (unsigned) status);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        gfxFBOInfo[gfxFBO].width = gfxTextureInfo[gfxTexture].width;
+        gfxFBOInfo[gfxFBO].height = gfxTextureInfo[gfxTexture].height;
+        CHECK_GL_ERRORS();
+}
+
+/* Give the FBO a depth buffer of the given size (or resize it) */
+void set_GfxFBO_depth_size(GfxFBO gfxFBO, int width, int height)
+{
+        if (gfxFBOInfo[gfxFBO].depthRenderbufferId == 0)
+                glGenRenderbuffers(1, &gfxFBOInfo[gfxFBO].depthRenderbufferId);
+        glBindRenderbuffer(GL_RENDERBUFFER, gfxFBOInfo[gfxFBO].depthRenderbufferId);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, gfxFBOInfo[gfxFBO].fboId);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER,
+                gfxFBOInfo[gfxFBO].depthRenderbufferId);
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        if (status != GL_FRAMEBUFFER_COMPLETE)
+                fatalf("Framebuffer is incomplete (status 0x%x)\n", (unsigned) status);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        CHECK_GL_ERRORS();
+}
+
+/* Subsequent draws go to the FBO. The viewport is set to cover all of it. */
+void bind_GfxFBO(GfxFBO gfxFBO)
+{
+        glBindFramebuffer(GL_FRAMEBUFFER, gfxFBOInfo[gfxFBO].fboId);
+        glViewport(0, 0, gfxFBOInfo[gfxFBO].width, gfxFBOInfo[gfxFBO].height);
+        CHECK_GL_ERRORS();
+}
+
+void bind_window_framebuffer(void)
+{
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, windowWidthInPixels, windowHeightInPixels);
+        CHECK_GL_ERRORS();
+}
+
+/* Draw to a rectangle of the current target only. bind_GfxFBO() and
+ * bind_window_framebuffer() reset the viewport to the whole target. */
+void set_viewport(int x, int y, int width, int height)
+{
+        glViewport(x, y, width, height);
+        CHECK_GL_ERRORS();
+}
+
+void set_blending(int blendMode)
+{
+        if (blendMode == BLEND_NONE)
+                glDisable(GL_BLEND);
+        else if (blendMode == BLEND_ALPHA) {
+                glEnable(GL_BLEND);
+                glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        }
+        else if (blendMode == BLEND_ALPHA_TO_LAYER) {
+                glEnable(GL_BLEND);
+                glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        }
+        else if (blendMode == BLEND_PREMULTIPLIED) {
+                glEnable(GL_BLEND);
+                glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        }
+        else if (blendMode == BLEND_ADDITIVE) {
+                glEnable(GL_BLEND);
+                glBlendFunc(GL_ONE, GL_ONE);
+        }
+        else
+                fatalf("Invalid value!\n");
+        CHECK_GL_ERRORS();
+}
+
+void set_depth_mode(int depthMode)
+{
+        if (depthMode == DEPTH_NONE) {
+                glDisable(GL_DEPTH_TEST);
+                glDepthMask(GL_TRUE);  // or clearing wouldn't work
+        }
+        else if (depthMode == DEPTH_TEST) {
+                glEnable(GL_DEPTH_TEST);
+                glDepthFunc(GL_LESS);
+                glDepthMask(GL_FALSE);
+        }
+        else if (depthMode == DEPTH_TEST_AND_WRITE) {
+                glEnable(GL_DEPTH_TEST);
+                glDepthFunc(GL_LESS);
+                glDepthMask(GL_TRUE);
+        }
+        else
+                fatalf("Invalid value!\n");
+        CHECK_GL_ERRORS();
+}
+
+/* Restrict drawing (including clears) to a rectangle of the current target.
+ * Coordinates are in pixels, with the origin at the lower left. */
+void set_scissor_rect(int x, int y, int width, int height)
+{
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(x, y, width, height);
+        CHECK_GL_ERRORS();
+}
+
+void unset_scissor_rect(void)
+{
+        glDisable(GL_SCISSOR_TEST);
+        CHECK_GL_ERRORS();
+}
+
 void clear_current_buffer(void)
 {
         CHECK_GL_ERRORS();
@@ -300,14 +655,37 @@ void clear_current_buffer(void)
 #else
         glEnable(GL_FRAMEBUFFER_SRGB);
 #endif
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glViewport(0, 0, windowWidthInPixels, windowHeightInPixels);
+        set_blending(BLEND_ALPHA);
         glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         CHECK_GL_ERRORS();
 }
 
+/* Clear to all zeroes. For layers that get composited on top of something */
+void clear_current_buffer_transparent(void)
+{
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        CHECK_GL_ERRORS();
+}
+
+/* Clear only the depth buffer (to the default, the far plane) */
+void clear_current_depth_buffer(void)
+{
+        glClear(GL_DEPTH_BUFFER_BIT);
+        CHECK_GL_ERRORS();
+}
+
+/* Read back a rectangle of the current target as 4 floats per pixel, rows
+ * from the bottom up. The target should have a float format. This waits for
+ * the GPU, so it's for diagnostics only. */
+void read_current_buffer_float(int x, int y, int width, int height, float *rgbaOut)
+{
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glReadPixels(x, y, width, height, GL_RGBA, GL_FLOAT, rgbaOut);
+        CHECK_GL_ERRORS();
+}
+
 void render_with_GfxProgram(GfxProgram gfxProgram, GfxVAO gfxVAO, int first, int count)
 {
         glUseProgram(gfxProgramInfo[gfxProgram].programId);
@@ -318,6 +696,266 @@ void render_with_GfxProgram(GfxProgram gfxProgram, GfxVAO gfxVAO, int first, int
         CHECK_GL_ERRORS();
 }
 
+void render_instanced_with_GfxProgram(GfxProgram gfxProgram, GfxVAO gfxVAO, int first, int count, int numInstances)
+{
+        glUseProgram(gfxProgramInfo[gfxProgram].programId);
+        bind_GfxVAO(gfxVAO);
+        draw_triangles_instanced(first, count, numInstances, 0);
+        bind_GfxVAO(-1);
+        glUseProgram(0);
+        CHECK_GL_ERRORS();
+}
+
+void use_GfxProgram(GfxProgram gfxProgram)
+{
+        glUseProgram(gfxProgram == -1 ? 0 : gfxProgramInfo[gfxProgram].programId);
+        CHECK_GL_ERRORS();
+}
+
+void bind_GfxVAO(GfxVAO gfxVAO)
+{
+        glBindVertexArray(gfxVAO == -1 ? 0 : gfxVAOInfo[gfxVAO].vaoId);
+        boundGfxVAO = gfxVAO;
+        CHECK_GL_ERRORS();
+}
+
+void set_uniform_1i(UniformLocation uniformLocation, int x)
+{
+        glUniform1i(uniformLocation, x);
+        CHECK_GL_ERRORS();
+}
+
+void set_uniform_1f(UniformLocation uniformLocation, float x)
+{
+        glUniform1f(uniformLocation, x);
+        CHECK_GL_ERRORS();
+}
+
+void set_uniform_4f(UniformLocation uniformLocation, float x, float y, float z, float w)
+{
+        glUniform4f(uniformLocation, x, y, z, w);
+        CHECK_GL_ERRORS();
+}
+
+void set_uniform_mat3f(UniformLocation uniformLocation, const float *nineFloats)
+{
+        glUniformMatrix3fv(uniformLocation, 1, GL_TRUE, nineFloats);
+        CHECK_GL_ERRORS();
+}
+
+void draw_triangles(int first, int count)
+{
+        glDrawArrays(GL_TRIANGLES, first, count);
+        CHECK_GL_ERRORS();
+}
+
+/* Instances are taken starting from baseInstance. This is emulated by
+ * pointing the instanced attributes of the bound VAO further into their
+ * buffers. */
+void draw_triangles_instanced(int first, int count, int numInstances, int baseInstance)
+{
+        struct GfxVAOInfo *info = &gfxVAOInfo[boundGfxVAO];
+        if (info->currentBaseInstance != baseInstance) {
+                for (int i = 0; i < info->numInstancedAttributes; i++) {
+                        const struct InstancedAttributeInfo *attr = &info->instancedAttributes[i];
+                        glBindBuffer(GL_ARRAY_BUFFER, gfxVBOInfo[attr->gfxVBO].vboId);
+                        glVertexAttribPointer(attr->attribLocation,
+                                attr->numFloats, GL_FLOAT, GL_FALSE, attr->stride,
+                                (char*)0 + attr->offset + (int64_t) baseInstance * attr->stride);
+                }
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+                info->currentBaseInstance = baseInstance;
+        }
+        glDrawArraysInstanced(GL_TRIANGLES, first, count, numInstances);
+        CHECK_GL_ERRORS();
+}
+
+#ifndef __EMSCRIPTEN__
+static int has_OpenGL_extension(const char *name)
+{
+        GLint numExtensions;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+        for (int i = 0; i < numExtensions; i++)
+                if (!strcmp((const char *) glGetStringi(GL_EXTENSIONS, i), name))
+                        return 1;
+        return 0;
+}
+
+static void wait_for_stream_section(int section)
+{
+        if (streamFences[section] == NULL)
+                return;
+        for (;;) {
+                GLenum result = glClientWaitSync(streamFences[section], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+                if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED)
+                        break;
+                if (result == GL_WAIT_FAILED)
+                        fatalf("glClientWaitSync() failed\n");
+        }
+        glDeleteSync(streamFences[section]);
+        streamFences[section] = NULL;
+}
+#endif
+
+static void allocate_stream_storage(uint64_t size)
+{
+        GLuint vboId = gfxVBOInfo[streamVBO].vboId;
+        if (vboId != 0) {
+                // make a new buffer. The old one may still be in use by the GPU
+#ifndef __EMSCRIPTEN__
+                for (int i = 0; i < NUM_STREAM_SECTIONS; i++)
+                        wait_for_stream_section(i);
+#endif
+                if (isStreamPersistent) {
+                        glBindBuffer(GL_ARRAY_BUFFER, vboId);
+                        glUnmapBuffer(GL_ARRAY_BUFFER);
+                        glBindBuffer(GL_ARRAY_BUFFER, 0);
+                }
+                glDeleteBuffers(1, &vboId);
+        }
+        glGenBuffers(1, &vboId);
+        gfxVBOInfo[streamVBO].vboId = vboId;
+        glBindBuffer(GL_ARRAY_BUFFER, vboId);
+#ifndef __EMSCRIPTEN__
+        if (isStreamPersistent) {
+                GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+                streamMapping = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+                if (streamMapping == NULL)
+                        fatalf("Failed to map the stream buffer\n");
+        }
+        else
+#endif
+                glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        streamSize = size;
+        streamHead = 0;
+        streamSection = 0;
+        // the VAOs that source from the stream must point to the new buffer
+        for (int i = 0; i < numGfxVAOs; i++)
+                gfxVAOInfo[i].currentBaseInstance = -1;
+        CHECK_GL_ERRORS();
+}
+
+static void setup_stream(void)
+{
+#ifndef __EMSCRIPTEN__
+        GLint majorVersion;
+        GLint minorVersion;
+        glGetIntegerv(GL_MAJOR_VERSION, &majorVersion);
+        glGetIntegerv(GL_MINOR_VERSION, &minorVersion);
+        if (majorVersion > 4 || (majorVersion == 4 && minorVersion >= 4)
+            || has_OpenGL_extension("GL_ARB_buffer_storage")) {
+                glBufferStorage = (PFNGLBUFFERSTORAGEPROC) get_OpenGL_function_pointer("glBufferStorage");
+                isStreamPersistent = glBufferStorage != NULL;
+        }
+        log_postf("Stream buffer uses %s\n", isStreamPersistent ? "persistent mapping" : "unsynchronized mapping");
+#endif
+        streamVBO = numGfxVBOs++;
+        REALLOC_MEMORY(&gfxVBOInfo, numGfxVBOs);
+        gfxVBOInfo[streamVBO].vboId = 0;
+        allocate_stream_storage(initialStreamSize);
+}
+
+GfxVBO get_stream_GfxVBO(void)
+{
+        return streamVBO;
+}
+
+/* Returns the offset in the stream buffer where the data was put. The offset
+ * is a multiple of the given alignment. */
+uint64_t write_to_stream(const void *data, uint64_t size, int alignment)
+{
+        uint64_t sectionSize = streamSize / NUM_STREAM_SECTIONS;
+        if (size + alignment > sectionSize) {
+                uint64_t newSize = streamSize;
+                while ((size + alignment) * NUM_STREAM_SECTIONS > newSize)
+                        newSize *= 2;
+                allocate_stream_storage(newSize);
+                sectionSize = streamSize / NUM_STREAM_SECTIONS;
+        }
+        uint64_t offset = (streamHead + alignment - 1) / alignment * alignment;
+        if (offset + size > (streamSection + 1) * sectionSize) {
+#ifndef __EMSCRIPTEN__
+                streamFences[streamSection] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+#endif
+                streamSection = (streamSection + 1) % NUM_STREAM_SECTIONS;
+#ifndef __EMSCRIPTEN__
+                wait_for_stream_section(streamSection);
+#endif
+                streamHead = streamSection * sectionSize;
+                offset = (streamHead + alignment - 1) / alignment * alignment;
+        }
+
+        GLuint vboId = gfxVBOInfo[streamVBO].vboId;
+        if (isStreamPersistent)
+                memcpy(streamMapping + offset, data, size);
+        else {
+                glBindBuffer(GL_ARRAY_BUFFER, vboId);
+#ifdef __EMSCRIPTEN__
+                glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+#else
+                GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+                void *ptr = glMapBufferRange(GL_ARRAY_BUFFER, offset, size, flags);
+                if (ptr == NULL)
+                        fatalf("Failed to map the stream buffer\n");
+                memcpy(ptr, data, size);
+                glUnmapBuffer(GL_ARRAY_BUFFER);
+#endif
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+        streamHead = offset + size;
+        CHECK_GL_ERRORS();
+        return offset;
+}
+
+int begin_gpu_timer(void)
+{
+#ifdef __EMSCRIPTEN__
+        return 0;
+#else
+        if (gpuTimerHead - gpuTimerTail == NUM_GPU_TIMER_QUERIES)
+                return 0;
+        glBeginQuery(GL_TIME_ELAPSED, gpuTimerQueries[gpuTimerHead % NUM_GPU_TIMER_QUERIES]);
+        isGpuTimerRunning = 1;
+        CHECK_GL_ERRORS();
+        return 1;
+#endif
+}
+
+void end_gpu_timer(void)
+{
+#ifndef __EMSCRIPTEN__
+        if (!isGpuTimerRunning)
+                return;
+        glEndQuery(GL_TIME_ELAPSED);
+        isGpuTimerRunning = 0;
+        gpuTimerHead++;
+        CHECK_GL_ERRORS();
+#endif
+}
+
+int poll_gpu_timer(double *outSeconds)
+{
+#ifdef __EMSCRIPTEN__
+        return 0;
+#else
+        if (gpuTimerTail == gpuTimerHead)
+                return 0;
+        GLuint queryId = gpuTimerQueries[gpuTimerTail % NUM_GPU_TIMER_QUERIES];
+        GLint isAvailable;
+        glGetQueryObjectiv(queryId, GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+        if (!isAvailable)
+                return 0;
+        GLuint64 nanoseconds;
+        glGetQueryObjectui64v(queryId, GL_QUERY_RESULT, &nanoseconds);
+        gpuTimerTail++;
+        *outSeconds = nanoseconds * 1e-9;
+        CHECK_GL_ERRORS();
+        return 1;
+#endif
+}
+
 void setup_gfx(void)
 {
         CHECK_GL_ERRORS();
@@ -347,6 +985,10 @@ void setup_gfx(void)
                         fatalf("OpenGL extension %s not found\n", name);
                 *openGLInitInfo[i].funcptr = funcptr;
         }
+#endif
+#ifndef __EMSCRIPTEN__
+        glGenQueries(NUM_GPU_TIMER_QUERIES, gpuTimerQueries);
 #endif
         CHECK_GL_ERRORS();
+        setup_stream();
 }
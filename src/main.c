@@ -1,6 +1,8 @@
 #include <shapes/window.h>
 #include <shapes/gfxrender.h>
 #include <shapes/shapes.h>
+#include <shapes/text.h>
+#include <shapes/workers.h>
 
 static void process_events(void)
 {
@@ -21,20 +23,32 @@ static void one_loop_iteration(void)
 {
         wait_for_events();
         process_events();
-        draw_shapes();
-        swap_buffers();
+        if (isRedrawNeeded) {
+                isRedrawNeeded = 0;
+                draw_shapes();
+                swap_buffers();
+        }
 }
 
 int main(void)
 {
+        setup_workers();
         setup_window();
         setup_gfx();
+        setup_text();
         setup_shapes();
         setup_shapesrender();
 
         Object c0 = add_circle(0.3f, 0.2f, 0.05f);
         Object c1 = add_circle(0.7f, 0.5f, 0.05f);
-        add_ellipse(c0, c1, 1.0f);
+        Object e = add_ellipse(c0, c1, 1.0f);
+        set_object_stroke(e, 0.005f, 0.2f, 0.3f, 0.4f);
+        set_object_label(c0, "Focus 1");
+        set_object_label(c1, "Focus 2");
+        set_object_label(e, "Ellipse");
+
+        Object r = add_roundrect(0.78f, 0.12f, 0.15f, 0.06f, 0.03f, 0.01f);
+        set_object_label(r, "Box");
 
 #ifdef __EMSCRIPTEN__
         emscripten_set_main_loop(&one_loop_iteration, 30, 1);
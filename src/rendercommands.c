@@ -0,0 +1,220 @@
+#include <shapes/defs.h>
+#include <shapes/logging.h>
+#include <shapes/memoryalloc.h>
+#include <shapes/rendercommands.h>
+#include <string.h>
+
+void reset_RenderCommandList(struct RenderCommandList *list)
+{
+        list->numCommands = 0;
+        list->numUniforms = 0;
+}
+
+void record_draw(struct RenderCommandList *list, int layer,
+        int programKey, GfxVAO gfxVAO, int blendMode,
+        int first, int count, int numInstances)
+{
+        ENSURE(0 <= layer && layer < 256);
+        ENSURE(0 <= blendMode && blendMode < 16);
+        ENSURE(0 <= programKey && programKey < (1 << 12));
+        ENSURE(0 <= gfxVAO && gfxVAO < (1 << 16));
+        ENSURE(list->numCommands < (1 << 24));
+        if (list->commandsCapacity <= list->numCommands) {
+                list->commandsCapacity = 2 * list->commandsCapacity + 16;
+                REALLOC_MEMORY(&list->commands, list->commandsCapacity);
+                REALLOC_MEMORY(&list->sortedCommands, list->commandsCapacity);
+        }
+        struct RenderCommand *cmd = &list->commands[list->numCommands];
+        cmd->sortKey = ((uint64_t) layer << 56)
+                | ((uint64_t) blendMode << 52)
+                | ((uint64_t) programKey << 40)
+                | ((uint64_t) gfxVAO << 24)
+                | (uint64_t) list->numCommands;
+        cmd->programKey = programKey;
+        cmd->gfxVAO = gfxVAO;
+        cmd->blendMode = blendMode;
+        cmd->depthMode = DEPTH_NONE;
+        cmd->gfxTexture = -1;
+        cmd->uploadData = NULL;
+        cmd->uploadSize = 0;
+        cmd->uploadStride = 1;
+        cmd->firstUniform = list->numUniforms;
+        cmd->numUniforms = 0;
+        cmd->first = first;
+        cmd->count = count;
+        cmd->numInstances = numInstances;
+        cmd->baseInstance = 0;
+        list->numCommands++;
+}
+
+static struct RenderCommand *get_last_command(struct RenderCommandList *list)
+{
+        ENSURE(list->numCommands > 0);
+        return &list->commands[list->numCommands - 1];
+}
+
+void record_upload(struct RenderCommandList *list, const void *data, uint64_t size, int stride)
+{
+        struct RenderCommand *cmd = get_last_command(list);
+        cmd->uploadData = data;
+        cmd->uploadSize = size;
+        cmd->uploadStride = stride;
+}
+
+void record_base_instance(struct RenderCommandList *list, int baseInstance)
+{
+        get_last_command(list)->baseInstance = baseInstance;
+}
+
+void record_depth_mode(struct RenderCommandList *list, int depthMode)
+{
+        get_last_command(list)->depthMode = depthMode;
+}
+
+void record_texture(struct RenderCommandList *list, GfxTexture gfxTexture)
+{
+        get_last_command(list)->gfxTexture = gfxTexture;
+}
+
+static struct RenderUniform *add_uniform(struct RenderCommandList *list, int renderuniformKind, int uniformIndex)
+{
+        struct RenderCommand *cmd = get_last_command(list);
+        ENSURE(cmd->firstUniform + cmd->numUniforms == list->numUniforms);
+        if (list->uniformsCapacity <= list->numUniforms) {
+                list->uniformsCapacity = 2 * list->uniformsCapacity + 16;
+                REALLOC_MEMORY(&list->uniforms, list->uniformsCapacity);
+        }
+        struct RenderUniform *uniform = &list->uniforms[list->numUniforms++];
+        uniform->renderuniformKind = renderuniformKind;
+        uniform->uniformIndex = uniformIndex;
+        cmd->numUniforms++;
+        return uniform;
+}
+
+void record_uniform_1i(struct RenderCommandList *list, int uniformIndex, int x)
+{
+        struct RenderUniform *uniform = add_uniform(list, RENDERUNIFORM_1I, uniformIndex);
+        uniform->intValue = x;
+}
+
+void record_uniform_1f(struct RenderCommandList *list, int uniformIndex, float x)
+{
+        struct RenderUniform *uniform = add_uniform(list, RENDERUNIFORM_1F, uniformIndex);
+        uniform->floatValues[0] = x;
+}
+
+void record_uniform_4f(struct RenderCommandList *list, int uniformIndex, float x, float y, float z, float w)
+{
+        struct RenderUniform *uniform = add_uniform(list, RENDERUNIFORM_4F, uniformIndex);
+        uniform->floatValues[0] = x;
+        uniform->floatValues[1] = y;
+        uniform->floatValues[2] = z;
+        uniform->floatValues[3] = w;
+}
+
+void record_uniform_mat3f(struct RenderCommandList *list, int uniformIndex, const float *nineFloats)
+{
+        struct RenderUniform *uniform = add_uniform(list, RENDERUNIFORM_MAT3F, uniformIndex);
+        memcpy(uniform->floatValues, nineFloats, 9 * sizeof (float));
+}
+
+/* LSD radix sort, one byte per pass. Passes where all keys have the same
+ * byte are skipped, which is the common case for the upper bytes. */
+void sort_RenderCommandList(struct RenderCommandList *list)
+{
+        struct RenderCommand *src = list->commands;
+        struct RenderCommand *dst = list->sortedCommands;
+        int n = list->numCommands;
+        for (int shift = 0; shift < 64; shift += 8) {
+                int counts[256] = { 0 };
+                for (int i = 0; i < n; i++)
+                        counts[(src[i].sortKey >> shift) & 0xff]++;
+                if (n == 0 || counts[(src[0].sortKey >> shift) & 0xff] == n)
+                        continue;
+                int offset = 0;
+                for (int b = 0; b < 256; b++) {
+                        int c = counts[b];
+                        counts[b] = offset;
+                        offset += c;
+                }
+                for (int i = 0; i < n; i++)
+                        dst[counts[(src[i].sortKey >> shift) & 0xff]++] = src[i];
+                struct RenderCommand *tmp = src;
+                src = dst;
+                dst = tmp;
+        }
+        // the sorted commands might have ended up in the scratch buffer
+        list->commands = src;
+        list->sortedCommands = dst;
+}
+
+static void apply_uniform(const struct RenderUniform *uniform, const UniformLocation *uniformLocations)
+{
+        UniformLocation location = uniformLocations[uniform->uniformIndex];
+        switch (uniform->renderuniformKind) {
+        case RENDERUNIFORM_1I:
+                set_uniform_1i(location, uniform->intValue);
+                break;
+        case RENDERUNIFORM_1F:
+                set_uniform_1f(location, uniform->floatValues[0]);
+                break;
+        case RENDERUNIFORM_4F:
+                set_uniform_4f(location, uniform->floatValues[0], uniform->floatValues[1], uniform->floatValues[2], uniform->floatValues[3]);
+                break;
+        case RENDERUNIFORM_MAT3F:
+                set_uniform_mat3f(location, uniform->floatValues);
+                break;
+        default:
+                UNREACHABLE();
+        }
+}
+
+void submit_RenderCommandList(struct RenderCommandList *list)
+{
+        sort_RenderCommandList(list);
+        int currentProgramKey = -1;
+        const UniformLocation *uniformLocations = NULL;
+        GfxVAO currentVAO = -1;
+        GfxTexture currentTexture = -1;
+        int currentBlendMode = -1;
+        int currentDepthMode = -1;
+        for (int i = 0; i < list->numCommands; i++) {
+                const struct RenderCommand *cmd = &list->commands[i];
+                if (cmd->blendMode != currentBlendMode) {
+                        currentBlendMode = cmd->blendMode;
+                        set_blending(currentBlendMode);
+                }
+                if (cmd->depthMode != currentDepthMode) {
+                        currentDepthMode = cmd->depthMode;
+                        set_depth_mode(currentDepthMode);
+                }
+                if (cmd->programKey != currentProgramKey) {
+                        currentProgramKey = cmd->programKey;
+                        use_GfxProgram(list->resolveProgram(currentProgramKey, &uniformLocations));
+                }
+                if (cmd->gfxVAO != currentVAO) {
+                        currentVAO = cmd->gfxVAO;
+                        bind_GfxVAO(currentVAO);
+                }
+                if (cmd->gfxTexture != -1 && cmd->gfxTexture != currentTexture) {
+                        currentTexture = cmd->gfxTexture;
+                        bind_GfxTexture(0, currentTexture);
+                }
+                int baseInstance = cmd->baseInstance;
+                if (cmd->uploadData != NULL) {
+                        uint64_t offset = write_to_stream(cmd->uploadData, cmd->uploadSize, cmd->uploadStride);
+                        baseInstance += (int) (offset / cmd->uploadStride);
+                }
+                for (int j = 0; j < cmd->numUniforms; j++)
+                        apply_uniform(&list->uniforms[cmd->firstUniform + j], uniformLocations);
+                if (cmd->numInstances > 0)
+                        draw_triangles_instanced(cmd->first, cmd->count, cmd->numInstances, baseInstance);
+                else
+                        draw_triangles(cmd->first, cmd->count);
+        }
+        bind_GfxVAO(-1);
+        use_GfxProgram(-1);
+        set_blending(BLEND_ALPHA);
+        set_depth_mode(DEPTH_NONE);
+        reset_RenderCommandList(list);
+}
@@ -4,9 +4,69 @@
 #include <shapes/memoryalloc.h>
 #include <shapes/window.h>
 #include <shapes/shapes.h>
+#include <shapes/workers.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
+enum {
+        // the spatial index keeps the union of the bounds of each block of entries
+        SPATIAL_BLOCK_SIZE = 64,
+        // the spatial index gets re-sorted after at least this many changes
+        MIN_CHANGES_BEFORE_COMPACTION = 64,
+        // below this number of objects, hit testing is done on the calling thread
+        PARALLEL_HIT_TEST_THRESHOLD = 1 << 16,
+        // culling sorts the hits if there are fewer than numObjects divided
+        // by this, and sweeps over all objects otherwise
+        CULL_SORT_HITS_DIVISOR = 32,
+};
+
+/* The spatial index holds the bounds of all objects, sorted along a Z-order
+ * (Morton) curve by compact_objects(), so that objects that are close in
+ * space are close in memory, too. Objects that were added since the last
+ * compaction are at the end. The objects array itself is never reordered:
+ * an Object is also the drawing order. */
+struct SpatialEntry {
+        struct Rect bounds;
+        Object obj;
+};
+
+struct MortonSortItem {
+        uint32_t code;
+        int entry;
+};
+
+/* A re-sort of the first numItems entries of the spatial index, running on a
+ * worker. */
+struct CompactionJob {
+        struct MortonSortItem *items;
+        int numItems;
+};
+
+struct HitTestResult {
+        Object topmostCircle;  // -1 if none
+        Object topmostRoundRect;  // -1 if none
+        Object topmostEllipse;  // -1 if none
+};
+
+struct HitTestTask {
+        float x;
+        float y;
+        struct HitTestResult *results;  // one per job
+};
+
+static int visibleObjectsCapacity;
+static int draggedObjectsCapacity;
+static int dirtyObjectsCapacity;
+static char *isObjectDirty;  // one per object
+static struct SpatialEntry *spatialEntries;  // one per object
+static int *spatialEntryOfObject;  // one per object
+static struct Rect *spatialBlockBounds;  // one per SPATIAL_BLOCK_SIZE entries
+static char *isObjectCulledIn;  // one per object, only set inside cull_objects()
+static int numChangesSinceCompaction;
+static struct CompactionJob compactionJob;
+static int isCompactionRunning;
+
 float distance2d(float x0, float y0, float x1, float y1)
 {
         float dx = (x0 - x1);
@@ -28,38 +88,574 @@ int test_ellipse_hit(const struct Ellipse *ellipse, float x, float y)
         return d0 + d1 < ellipse->radius;
 }
 
+/* Signed distance to the outer edge, negative inside. Same as in the
+ * rounded rectangle shader. */
+static float get_roundrect_distance(const struct RoundRect *rect, float x, float y)
+{
+        float r = rect->cornerRadius;
+        float qx = fabsf(x - rect->centerX) - (rect->halfWidth - r);
+        float qy = fabsf(y - rect->centerY) - (rect->halfHeight - r);
+        float outside = sqrtf(fmaxf(qx, 0.0f) * fmaxf(qx, 0.0f) + fmaxf(qy, 0.0f) * fmaxf(qy, 0.0f));
+        return outside + fminf(fmaxf(qx, qy), 0.0f) - r;
+}
+
+/* Only the outline can be grabbed, so that the objects inside can be, too */
+int test_roundrect_hit(const struct RoundRect *rect, float x, float y)
+{
+        float d = get_roundrect_distance(rect, x, y);
+        return d < 0.0f && d > -rect->thickness;
+}
+
 int test_object_hit(Object obj, float x, float y)
 {
         if (objects[obj].objectKind == OBJECT_CIRCLE)
                 return test_circle_hit(&objects[obj].data.tCircle, x, y);
         else if (objects[obj].objectKind == OBJECT_ELLIPSE)
                 return test_ellipse_hit(&objects[obj].data.tEllipse, x, y);
+        else if (objects[obj].objectKind == OBJECT_ROUNDRECT)
+                return test_roundrect_hit(&objects[obj].data.tRoundRect, x, y);
         else
                 UNREACHABLE();
 }
 
-Object add_circle(float x, float y, float radius)
+static int test_point_in_rect(const struct Rect *rect, float x, float y)
+{
+        return rect->minX <= x && x <= rect->maxX && rect->minY <= y && y <= rect->maxY;
+}
+
+static int get_num_spatial_blocks(void)
+{
+        return (numObjects + SPATIAL_BLOCK_SIZE - 1) / SPATIAL_BLOCK_SIZE;
+}
+
+/* Circles are drawn on top of rounded rectangles, which are drawn on top of
+ * ellipses, and objects of the same kind are drawn in order. The topmost hit
+ * is therefore the highest hit of the topmost kind that was hit at all. The
+ * spatial index is not in drawing order, so all candidates are tested. */
+static void hit_test_blocks(int firstBlock, int endBlock, float x, float y, struct HitTestResult *out)
+{
+        out->topmostCircle = -1;
+        out->topmostRoundRect = -1;
+        out->topmostEllipse = -1;
+        for (int block = firstBlock; block < endBlock; block++) {
+                if (!test_point_in_rect(&spatialBlockBounds[block], x, y))
+                        continue;
+                int first = block * SPATIAL_BLOCK_SIZE;
+                int end = first + SPATIAL_BLOCK_SIZE < numObjects ? first + SPATIAL_BLOCK_SIZE : numObjects;
+                for (int i = first; i < end; i++) {
+                        if (!test_point_in_rect(&spatialEntries[i].bounds, x, y))
+                                continue;
+                        Object obj = spatialEntries[i].obj;
+                        if (objects[obj].objectKind == OBJECT_CIRCLE) {
+                                if (obj > out->topmostCircle && test_circle_hit(&objects[obj].data.tCircle, x, y))
+                                        out->topmostCircle = obj;
+                        }
+                        else if (objects[obj].objectKind == OBJECT_ELLIPSE) {
+                                if (obj > out->topmostEllipse && test_ellipse_hit(&objects[obj].data.tEllipse, x, y))
+                                        out->topmostEllipse = obj;
+                        }
+                        else if (objects[obj].objectKind == OBJECT_ROUNDRECT) {
+                                if (obj > out->topmostRoundRect && test_roundrect_hit(&objects[obj].data.tRoundRect, x, y))
+                                        out->topmostRoundRect = obj;
+                        }
+                }
+        }
+}
+
+static void hit_test_job(void *arg, int jobIndex, int numJobs)
+{
+        struct HitTestTask *task = arg;
+        int numBlocks = get_num_spatial_blocks();
+        int firstBlock = (int) ((int64_t) numBlocks * jobIndex / numJobs);
+        int endBlock = (int) ((int64_t) numBlocks * (jobIndex + 1) / numJobs);
+        hit_test_blocks(firstBlock, endBlock, task->x, task->y, &task->results[jobIndex]);
+}
+
+/* Returns the topmost object at the given world position, or -1 */
+static Object find_topmost_object_at(float x, float y)
+{
+        struct HitTestResult result;
+        if (numObjects < PARALLEL_HIT_TEST_THRESHOLD || numWorkerThreads <= 1)
+                hit_test_blocks(0, get_num_spatial_blocks(), x, y, &result);
+        else {
+                int numJobs = numWorkerThreads;
+                struct HitTestTask task;
+                task.x = x;
+                task.y = y;
+                ALLOC_MEMORY(&task.results, numJobs);
+                run_parallel(&hit_test_job, &task, numJobs);
+                result.topmostCircle = -1;
+                result.topmostRoundRect = -1;
+                result.topmostEllipse = -1;
+                for (int i = 0; i < numJobs; i++) {
+                        if (task.results[i].topmostCircle > result.topmostCircle)
+                                result.topmostCircle = task.results[i].topmostCircle;
+                        if (task.results[i].topmostRoundRect > result.topmostRoundRect)
+                                result.topmostRoundRect = task.results[i].topmostRoundRect;
+                        if (task.results[i].topmostEllipse > result.topmostEllipse)
+                                result.topmostEllipse = task.results[i].topmostEllipse;
+                }
+                FREE_MEMORY(&task.results);
+        }
+        if (result.topmostCircle != -1)
+                return result.topmostCircle;
+        if (result.topmostRoundRect != -1)
+                return result.topmostRoundRect;
+        return result.topmostEllipse;
+}
+
+void get_object_position(Object obj, float *outX, float *outY)
+{
+        if (objects[obj].objectKind == OBJECT_CIRCLE) {
+                *outX = objects[obj].data.tCircle.centerX;
+                *outY = objects[obj].data.tCircle.centerY;
+        }
+        else if (objects[obj].objectKind == OBJECT_ELLIPSE) {
+                struct Ellipse *ellipse = &objects[obj].data.tEllipse;
+                struct Circle *c0 = &objects[ellipse->centerCircle0].data.tCircle;
+                struct Circle *c1 = &objects[ellipse->centerCircle1].data.tCircle;
+                *outX = 0.5f * (c0->centerX + c1->centerX);
+                *outY = 0.5f * (c0->centerY + c1->centerY);
+        }
+        else if (objects[obj].objectKind == OBJECT_ROUNDRECT) {
+                *outX = objects[obj].data.tRoundRect.centerX;
+                *outY = objects[obj].data.tRoundRect.centerY;
+        }
+        else
+                UNREACHABLE();
+}
+
+static void get_ellipse_bounds(const struct Ellipse *ellipse, struct Rect *outRect)
+{
+        const struct Circle *c0 = &objects[ellipse->centerCircle0].data.tCircle;
+        const struct Circle *c1 = &objects[ellipse->centerCircle1].data.tCircle;
+        float centerX = 0.5f * (c0->centerX + c1->centerX);
+        float centerY = 0.5f * (c0->centerY + c1->centerY);
+        float c = 0.5f * distance2d(c0->centerX, c0->centerY, c1->centerX, c1->centerY);
+        float a = 0.5f * ellipse->radius;
+        float halfW = 0.0f;
+        float halfH = 0.0f;
+        if (a > c) {
+                // half extents of the rotated ellipse
+                float b = sqrtf(a * a - c * c);
+                float ux = c > 0.0f ? (c1->centerX - c0->centerX) / (2.0f * c) : 1.0f;
+                float uy = c > 0.0f ? (c1->centerY - c0->centerY) / (2.0f * c) : 0.0f;
+                halfW = sqrtf(a * a * ux * ux + b * b * uy * uy);
+                halfH = sqrtf(a * a * uy * uy + b * b * ux * ux);
+        }
+        outRect->minX = centerX - halfW;
+        outRect->minY = centerY - halfH;
+        outRect->maxX = centerX + halfW;
+        outRect->maxY = centerY + halfH;
+}
+
+void get_object_bounds(Object obj, struct Rect *outRect)
+{
+        if (objects[obj].objectKind == OBJECT_CIRCLE) {
+                const struct Circle *circle = &objects[obj].data.tCircle;
+                outRect->minX = circle->centerX - circle->radius;
+                outRect->minY = circle->centerY - circle->radius;
+                outRect->maxX = circle->centerX + circle->radius;
+                outRect->maxY = circle->centerY + circle->radius;
+        }
+        else if (objects[obj].objectKind == OBJECT_ELLIPSE)
+                get_ellipse_bounds(&objects[obj].data.tEllipse, outRect);
+        else if (objects[obj].objectKind == OBJECT_ROUNDRECT) {
+                const struct RoundRect *rect = &objects[obj].data.tRoundRect;
+                outRect->minX = rect->centerX - rect->halfWidth;
+                outRect->minY = rect->centerY - rect->halfHeight;
+                outRect->maxX = rect->centerX + rect->halfWidth;
+                outRect->maxY = rect->centerY + rect->halfHeight;
+        }
+        else
+                UNREACHABLE();
+}
+
+int test_rects_overlap(const struct Rect *a, const struct Rect *b)
+{
+        return a->minX <= b->maxX && b->minX <= a->maxX
+                && a->minY <= b->maxY && b->minY <= a->maxY;
+}
+
+static int compare_Object(const void *a, const void *b)
+{
+        Object x = *(const Object *) a;
+        Object y = *(const Object *) b;
+        return (x > y) - (x < y);
+}
+
+/* The hits come out of the spatial index in no particular order, but they
+ * are needed in increasing order, which is the drawing order. A few hits get
+ * sorted. If a good part of the scene is visible, marking them and sweeping
+ * over all objects is cheaper. */
+void cull_objects(const struct Rect *rect)
+{
+        if (visibleObjectsCapacity < numObjects) {
+                visibleObjectsCapacity = numObjects;
+                REALLOC_MEMORY(&visibleObjects, visibleObjectsCapacity);
+        }
+        int numHits = 0;
+        int numBlocks = get_num_spatial_blocks();
+        for (int block = 0; block < numBlocks; block++) {
+                if (!test_rects_overlap(&spatialBlockBounds[block], rect))
+                        continue;
+                int first = block * SPATIAL_BLOCK_SIZE;
+                int end = first + SPATIAL_BLOCK_SIZE < numObjects ? first + SPATIAL_BLOCK_SIZE : numObjects;
+                for (int i = first; i < end; i++)
+                        if (test_rects_overlap(&spatialEntries[i].bounds, rect))
+                                visibleObjects[numHits++] = spatialEntries[i].obj;
+        }
+        if (numHits < numObjects / CULL_SORT_HITS_DIVISOR) {
+                qsort(visibleObjects, numHits, sizeof *visibleObjects, &compare_Object);
+                numVisibleObjects = numHits;
+                return;
+        }
+        for (int i = 0; i < numHits; i++)
+                isObjectCulledIn[visibleObjects[i]] = 1;
+        numVisibleObjects = 0;
+        for (Object i = 0; numVisibleObjects < numHits; i++) {
+                if (isObjectCulledIn[i]) {
+                        isObjectCulledIn[i] = 0;
+                        visibleObjects[numVisibleObjects++] = i;
+                }
+        }
+}
+
+static void merge_rects(struct Rect *a, const struct Rect *b)
+{
+        a->minX = fminf(a->minX, b->minX);
+        a->minY = fminf(a->minY, b->minY);
+        a->maxX = fmaxf(a->maxX, b->maxX);
+        a->maxY = fmaxf(a->maxY, b->maxY);
+}
+
+/* The union of the bounds of all objects, taken from the blocks of the
+ * spatial index. The unit square if there are no objects. */
+void get_scene_bounds(struct Rect *outRect)
+{
+        int numBlocks = get_num_spatial_blocks();
+        if (numBlocks == 0) {
+                outRect->minX = 0.0f;
+                outRect->minY = 0.0f;
+                outRect->maxX = 1.0f;
+                outRect->maxY = 1.0f;
+                return;
+        }
+        *outRect = spatialBlockBounds[0];
+        for (int i = 1; i < numBlocks; i++)
+                merge_rects(outRect, &spatialBlockBounds[i]);
+}
+
+/* Overlapping rectangles are merged. If there are too many rectangles, they
+ * all get merged into one. */
+void add_damage_rect(const struct Rect *rect)
+{
+        isRedrawNeeded = 1;
+        if (isDamagedEverywhere)
+                return;
+        for (int i = 0; i < numDamageRects; i++) {
+                if (test_rects_overlap(&damageRects[i], rect)) {
+                        merge_rects(&damageRects[i], rect);
+                        return;
+                }
+        }
+        if (numDamageRects == MAX_DAMAGE_RECTS) {
+                for (int i = 1; i < numDamageRects; i++)
+                        merge_rects(&damageRects[0], &damageRects[i]);
+                merge_rects(&damageRects[0], rect);
+                numDamageRects = 1;
+                return;
+        }
+        damageRects[numDamageRects++] = *rect;
+}
+
+void damage_everything(void)
+{
+        isRedrawNeeded = 1;
+        isDamagedEverywhere = 1;
+        numDamageRects = 0;
+}
+
+void reset_damage(void)
+{
+        isDamagedEverywhere = 0;
+        numDamageRects = 0;
+}
+
+static void mark_object_dirty(Object obj)
+{
+        if (isObjectDirty[obj])
+                return;
+        isObjectDirty[obj] = 1;
+        if (dirtyObjectsCapacity <= numDirtyObjects) {
+                dirtyObjectsCapacity = 2 * dirtyObjectsCapacity + 16;
+                REALLOC_MEMORY(&dirtyObjects, dirtyObjectsCapacity);
+        }
+        dirtyObjects[numDirtyObjects++] = obj;
+}
+
+void reset_dirty_objects(void)
+{
+        for (int i = 0; i < numDirtyObjects; i++)
+                isObjectDirty[dirtyObjects[i]] = 0;
+        numDirtyObjects = 0;
+}
+
+static void update_spatial_block(int block)
+{
+        int first = block * SPATIAL_BLOCK_SIZE;
+        int end = first + SPATIAL_BLOCK_SIZE < numObjects ? first + SPATIAL_BLOCK_SIZE : numObjects;
+        spatialBlockBounds[block] = spatialEntries[first].bounds;
+        for (int i = first + 1; i < end; i++)
+                merge_rects(&spatialBlockBounds[block], &spatialEntries[i].bounds);
+}
+
+/* When an object moves, call this both before and after the move so that the
+ * old and the new bounds get damaged. This also keeps the spatial index up
+ * to date. */
+static void damage_object(Object obj)
+{
+        mark_object_dirty(obj);
+        struct Rect bounds;
+        get_object_bounds(obj, &bounds);
+        add_damage_rect(&bounds);
+        int entry = spatialEntryOfObject[obj];
+        spatialEntries[entry].bounds = bounds;
+        update_spatial_block(entry / SPATIAL_BLOCK_SIZE);
+}
+
+/* Something in the scene changed. The caller is responsible for adding the
+ * damage. */
+static void note_scene_change(void)
+{
+        numChangesSinceCompaction++;
+        sceneContentVersion++;
+}
+
+/* Grows the per-object arrays for a new object and appends it to the
+ * spatial index. The bounds get filled in by damage_object(). */
+static Object new_object(void)
 {
         int obj = numObjects++;
         REALLOC_MEMORY(&objects, numObjects);
+        REALLOC_MEMORY(&isObjectDirty, numObjects);
+        REALLOC_MEMORY(&isObjectCulledIn, numObjects);
+        REALLOC_MEMORY(&spatialEntries, numObjects);
+        REALLOC_MEMORY(&spatialEntryOfObject, numObjects);
+        REALLOC_MEMORY(&spatialBlockBounds, get_num_spatial_blocks());
+        isObjectDirty[obj] = 0;
+        isObjectCulledIn[obj] = 0;
+        spatialEntries[obj].obj = obj;
+        spatialEntryOfObject[obj] = obj;
+        sceneStructureVersion++;
+        return obj;
+}
+
+Object add_circle(float x, float y, float radius)
+{
+        note_scene_change();
+        Object obj = new_object();
         objects[obj].objectKind = OBJECT_CIRCLE;
+        objects[obj].strokeWidth = 0.0f;
+        objects[obj].strokeColor[0] = 0.0f;
+        objects[obj].strokeColor[1] = 0.0f;
+        objects[obj].strokeColor[2] = 0.0f;
+        objects[obj].label = NULL;
         objects[obj].data.tCircle.centerX = x;
         objects[obj].data.tCircle.centerY = y;
         objects[obj].data.tCircle.radius = radius;
+        damage_object(obj);
         return obj;
 }
 
 Object add_ellipse(Object centerCircle0, Object centerCircle1, float radius)
 {
-        int obj = numObjects++;
-        REALLOC_MEMORY(&objects, numObjects);
+        note_scene_change();
+        Object obj = new_object();
         objects[obj].objectKind = OBJECT_ELLIPSE;
+        objects[obj].strokeWidth = 0.0f;
+        objects[obj].strokeColor[0] = 0.0f;
+        objects[obj].strokeColor[1] = 0.0f;
+        objects[obj].strokeColor[2] = 0.0f;
+        objects[obj].label = NULL;
         objects[obj].data.tEllipse.centerCircle0 = centerCircle0;
         objects[obj].data.tEllipse.centerCircle1 = centerCircle1;
         objects[obj].data.tEllipse.radius = radius;
+        damage_object(obj);
+        return obj;
+}
+
+Object add_roundrect(float x, float y, float halfWidth, float halfHeight, float cornerRadius, float thickness)
+{
+        note_scene_change();
+        Object obj = new_object();
+        objects[obj].objectKind = OBJECT_ROUNDRECT;
+        objects[obj].strokeWidth = 0.0f;
+        objects[obj].strokeColor[0] = 0.0f;
+        objects[obj].strokeColor[1] = 0.0f;
+        objects[obj].strokeColor[2] = 0.0f;
+        objects[obj].label = NULL;
+        objects[obj].data.tRoundRect.centerX = x;
+        objects[obj].data.tRoundRect.centerY = y;
+        objects[obj].data.tRoundRect.halfWidth = halfWidth;
+        objects[obj].data.tRoundRect.halfHeight = halfHeight;
+        objects[obj].data.tRoundRect.cornerRadius = fminf(cornerRadius, fminf(halfWidth, halfHeight));
+        objects[obj].data.tRoundRect.thickness = thickness;
+        damage_object(obj);
         return obj;
 }
 
+void set_object_stroke(Object obj, float width, float r, float g, float b)
+{
+        objects[obj].strokeWidth = width;
+        objects[obj].strokeColor[0] = r;
+        objects[obj].strokeColor[1] = g;
+        objects[obj].strokeColor[2] = b;
+        note_scene_change();
+        damage_object(obj);
+}
+
+/* Labels are drawn over the scene each frame, so nothing gets damaged */
+void set_object_label(Object obj, const char *text)
+{
+        FREE_MEMORY(&objects[obj].label);
+        if (text) {
+                int length = (int) strlen(text);
+                ALLOC_MEMORY(&objects[obj].label, length + 1);
+                memcpy(objects[obj].label, text, length + 1);
+        }
+        labelVersion++;
+        isRedrawNeeded = 1;
+}
+
+static void collect_dragged_objects(void)
+{
+        numDraggedObjects = 0;
+        for (Object i = 0; i < numObjects; i++) {
+                int isDragged = i == activeObject;
+                if (objects[i].objectKind == OBJECT_ELLIPSE) {
+                        struct Ellipse *ellipse = &objects[i].data.tEllipse;
+                        if (ellipse->centerCircle0 == activeObject || ellipse->centerCircle1 == activeObject)
+                                isDragged = 1;
+                }
+                if (!isDragged)
+                        continue;
+                if (draggedObjectsCapacity <= numDraggedObjects) {
+                        draggedObjectsCapacity = 2 * draggedObjectsCapacity + 16;
+                        REALLOC_MEMORY(&draggedObjects, draggedObjectsCapacity);
+                }
+                draggedObjects[numDraggedObjects++] = i;
+        }
+}
+
+static void damage_dragged_objects(void)
+{
+        for (int i = 0; i < numDraggedObjects; i++)
+                damage_object(draggedObjects[i]);
+}
+
+/* interleave the lower 16 bits of x with zeroes */
+static uint32_t spread_morton_bits(uint32_t x)
+{
+        x &= 0x0000ffff;
+        x = (x | (x << 8)) & 0x00ff00ff;
+        x = (x | (x << 4)) & 0x0f0f0f0f;
+        x = (x | (x << 2)) & 0x33333333;
+        x = (x | (x << 1)) & 0x55555555;
+        return x;
+}
+
+/* x and y are expected to be normalized to [0,1] */
+static uint32_t compute_morton_code(float x, float y)
+{
+        uint32_t qx = (uint32_t) (x * 65535.0f + 0.5f);
+        uint32_t qy = (uint32_t) (y * 65535.0f + 0.5f);
+        return spread_morton_bits(qx) | (spread_morton_bits(qy) << 1);
+}
+
+static int compare_MortonSortItem(const void *a, const void *b)
+{
+        const struct MortonSortItem *x = a;
+        const struct MortonSortItem *y = b;
+        if (x->code != y->code)
+                return x->code < y->code ? -1 : 1;
+        return x->entry - y->entry;  // keep it stable
+}
+
+static void sort_morton_items_job(void *arg, int jobIndex, int numJobs)
+{
+        UNUSED(jobIndex);
+        UNUSED(numJobs);
+        struct CompactionJob *job = arg;
+        qsort(job->items, job->numItems, sizeof *job->items, &compare_MortonSortItem);
+}
+
+/* Computes the Morton codes of the current entries and leaves sorting them
+ * to a worker. The worker only touches the job, so the scene can change
+ * meanwhile. */
+void compact_objects(void)
+{
+        if (isCompactionRunning)
+                return;
+        numChangesSinceCompaction = 0;
+        if (numObjects < 2)
+                return;
+        struct Rect all;
+        get_scene_bounds(&all);
+        float scaleX = all.maxX > all.minX ? 1.0f / (all.maxX - all.minX) : 0.0f;
+        float scaleY = all.maxY > all.minY ? 1.0f / (all.maxY - all.minY) : 0.0f;
+
+        compactionJob.numItems = numObjects;
+        ALLOC_MEMORY(&compactionJob.items, numObjects);
+        for (int i = 0; i < numObjects; i++) {
+                const struct Rect *bounds = &spatialEntries[i].bounds;
+                float x = 0.5f * (bounds->minX + bounds->maxX);
+                float y = 0.5f * (bounds->minY + bounds->maxY);
+                compactionJob.items[i].code = compute_morton_code((x - all.minX) * scaleX, (y - all.minY) * scaleY);
+                compactionJob.items[i].entry = i;
+        }
+        isCompactionRunning = 1;
+        start_background_job(&sort_morton_items_job, &compactionJob);
+}
+
+/* Entries only move here, so the sorted items still refer to the right
+ * entries, even if their bounds changed since. Objects that were added in the
+ * meantime stay at the end. */
+static void finish_compaction(void)
+{
+        struct SpatialEntry *sortedEntries;
+        ALLOC_MEMORY(&sortedEntries, numObjects);
+        for (int i = 0; i < numObjects; i++) {
+                int entry = i < compactionJob.numItems ? compactionJob.items[i].entry : i;
+                sortedEntries[i] = spatialEntries[entry];
+                spatialEntryOfObject[sortedEntries[i].obj] = i;
+        }
+        FREE_MEMORY(&spatialEntries);
+        spatialEntries = sortedEntries;
+        int numBlocks = get_num_spatial_blocks();
+        for (int i = 0; i < numBlocks; i++)
+                update_spatial_block(i);
+        FREE_MEMORY(&compactionJob.items);
+        isCompactionRunning = 0;
+}
+
+/* Called after each input, so hit testing and culling never wait for a
+ * compaction. One gets started once a good part of the scene changed since
+ * the last one, and the result gets swapped in when the worker is done.
+ * Neither happens during a drag though, so that dragging doesn't stutter.
+ * Time ticks keep coming while a compaction is running, so that its result
+ * gets picked up even if there is no other input. */
+static void update_compaction(void)
+{
+        if (!isCompactionRunning && isCompactionEnabled && !isDraggingObject
+            && numChangesSinceCompaction >= MIN_CHANGES_BEFORE_COMPACTION
+            && numChangesSinceCompaction >= numObjects / 4)
+                compact_objects();
+        if (isCompactionRunning && !isDraggingObject && is_background_job_done())
+                finish_compaction();
+        areTimeticksNeeded = isCompactionRunning;
+}
+
 void update_shapes(struct Input input)
 {
         if (input.inputKind == INPUT_CURSORMOVE) {
@@ -74,6 +670,7 @@ void update_shapes(struct Input input)
                 mousePosX = unprojMat[0][0] * mousePosX + unprojMat[0][2];
                 mousePosY = unprojMat[1][1] * mousePosY + unprojMat[1][2];
                 if (isDraggingObject) {
+                        damage_dragged_objects();
                         float mouseDiffX = (mousePosX - mouseStartX);
                         float mouseDiffY = (mousePosY - mouseStartY);
                         struct Object *obj = &objects[activeObject];
@@ -84,16 +681,25 @@ void update_shapes(struct Input input)
                                 obj->data.tCircle.centerX = objectStartX + mouseDiffX;
                                 obj->data.tCircle.centerY = objectStartY + mouseDiffY;
                         }
+                        else if (obj->objectKind == OBJECT_ROUNDRECT) {
+                                obj->data.tRoundRect.centerX = objectStartX + mouseDiffX;
+                                obj->data.tRoundRect.centerY = objectStartY + mouseDiffY;
+                        }
+                        note_scene_change();
+                        damage_dragged_objects();
                 }
                 else {
-                        isHoveringObject = 0;
-                        for (Object i = 0; i < numObjects; i++) {
-                                if (test_object_hit(i, mousePosX, mousePosY)) {
-                                        isHoveringObject = 1;
-                                        activeObject = i;
-                                        break;
-                                }
+                        Object obj = find_topmost_object_at(mousePosX, mousePosY);
+                        // the hovered object is highlighted
+                        if (isHoveringObject != (obj != -1) || (obj != -1 && obj != activeObject)) {
+                                if (isHoveringObject)
+                                        damage_object(activeObject);
+                                if (obj != -1)
+                                        damage_object(obj);
                         }
+                        isHoveringObject = obj != -1;
+                        if (isHoveringObject)
+                                activeObject = obj;
                 }
         }
         else if (input.inputKind == INPUT_MOUSEBUTTON) {
@@ -101,6 +707,8 @@ void update_shapes(struct Input input)
                         if (input.data.tMousebutton.mousebuttonEventKind == MOUSEBUTTONEVENT_PRESS) {
                                 if (isHoveringObject) {
                                         isDraggingObject = 1;
+                                        collect_dragged_objects();
+                                        damage_object(activeObject);
                                         mouseStartX = mousePosX;
                                         mouseStartY = mousePosY;
                                         if (objects[activeObject].objectKind == OBJECT_CIRCLE) {
@@ -112,14 +720,22 @@ void update_shapes(struct Input input)
                                                 struct Ellipse *ellipse = &objects[activeObject].data.tEllipse;
                                                 objectStartRadius = ellipse->radius;
                                         }
+                                        else if (objects[activeObject].objectKind == OBJECT_ROUNDRECT) {
+                                                struct RoundRect *rect = &objects[activeObject].data.tRoundRect;
+                                                objectStartX = rect->centerX;
+                                                objectStartY = rect->centerY;
+                                        }
                                 }
                         }
                         else if (input.data.tMousebutton.mousebuttonEventKind == MOUSEBUTTONEVENT_RELEASE) {
+                                if (isDraggingObject)
+                                        damage_object(activeObject);
                                 isDraggingObject = 0;
                         }
                 }
         }
         else if (input.inputKind == INPUT_SCROLL) {
+                float oldZoomFactor = zoomFactor;
                 if (input.data.tScroll.scrollKind == SCROLL_UP) {
                         zoomFactor += 0.5f;
                         if (zoomFactor > 5.0f)
@@ -130,10 +746,38 @@ void update_shapes(struct Input input)
                         if (zoomFactor < 1.0f)
                                 zoomFactor = 1.0f;
                 }
+                // Only the view changes, not the picture. The renderer
+                // notices the new zoom factor.
+                if (zoomFactor != oldZoomFactor)
+                        isRedrawNeeded = 1;
+        }
+        else if (input.inputKind == INPUT_KEY) {
+                if (input.data.tKey.keyEventKind == KEYEVENT_PRESS
+                    && input.data.tKey.keyKind == KEY_L) {
+                        isMatcapEnabled = !isMatcapEnabled;
+                        damage_everything();
+                }
+                else if (input.data.tKey.keyEventKind == KEYEVENT_PRESS
+                         && input.data.tKey.keyKind == KEY_O) {
+                        isOverdrawHeatmapEnabled = !isOverdrawHeatmapEnabled;
+                        damage_everything();
+                }
+                else if (input.data.tKey.keyEventKind == KEYEVENT_PRESS
+                         && input.data.tKey.keyKind == KEY_R) {
+                        isDynamicResolutionEnabled = !isDynamicResolutionEnabled;
+                        damage_everything();
+                }
+        }
+        else if (input.inputKind == INPUT_WINDOWRESIZE || input.inputKind == INPUT_WINDOWEXPOSE) {
+                damage_everything();
         }
+        update_compaction();
 }
 
 void setup_shapes(void)
 {
         zoomFactor = 1.0f;
+        isCompactionEnabled = 1;
+        isMatcapEnabled = 1;
+        damage_everything();
 }
@@ -1,42 +1,162 @@
 #include <shapes/defs.h>
 #include <shapes/gfxrender.h>
 #include <shapes/logging.h>
+#include <shapes/memoryalloc.h>
+#include <shapes/rendercommands.h>
 #include <shapes/window.h>
 #include <shapes/shapes.h>
+#include <shapes/text.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 enum {
         PROGRAM_ELLIPSE,
         PROGRAM_CIRCLE,
-        PROGRAM_TEST,
+        PROGRAM_ROUNDRECT,
+        PROGRAM_SPLAT,
+        PROGRAM_COMPOSITE,
+        PROGRAM_HEATMAP,
+        PROGRAM_TEXT,
         NUM_PROGRAM_KINDS,
 };
 
+static const char *const programName[NUM_PROGRAM_KINDS] = {
+        [PROGRAM_ELLIPSE] = "ellipse",
+        [PROGRAM_CIRCLE] = "circle",
+        [PROGRAM_ROUNDRECT] = "roundrect",
+        [PROGRAM_SPLAT] = "splat",
+        [PROGRAM_COMPOSITE] = "composite",
+        [PROGRAM_HEATMAP] = "heatmap",
+        [PROGRAM_TEXT] = "text",
+};
+
+/* Features that programs can be compiled with. Each one is a #define in the
+ * shader source, and a program kind is compiled once for each combination
+ * of features it is used with. Antialiasing, instancing and the level of
+ * detail are not features. Every shape program is instanced and antialiases
+ * with its distance function. The splat LOD needs a different instance
+ * layout, so it is a program kind of its own. */
+enum {
+        SHADERFEATURE_MATCAP,  // light circles with the matcap
+        SHADERFEATURE_OPAQUE_INTERIOR,  // draw only the fully covered pixels of a shape
+        SHADERFEATURE_EDGE_BAND,  // draw only the partially covered pixels
+        SHADERFEATURE_OVERDRAW,  // output 1 for each fragment, to count them
+        SHADERFEATURE_FLAT,  // no lighting, for small views
+        NUM_SHADERFEATURE_KINDS,
+};
+
+static const char *const shaderFeatureDefine[NUM_SHADERFEATURE_KINDS] = {
+        [SHADERFEATURE_MATCAP] = "#define MATCAP\n",
+        [SHADERFEATURE_OPAQUE_INTERIOR] = "#define OPAQUE_INTERIOR\n",
+        [SHADERFEATURE_EDGE_BAND] = "#define EDGE_BAND\n",
+        [SHADERFEATURE_OVERDRAW] = "#define OVERDRAW\n",
+        [SHADERFEATURE_FLAT] = "#define FLAT\n",
+};
+
+/* Shader code that discards the pixels that the OPAQUE_INTERIOR or EDGE_BAND
+ * pass doesn't draw, given the coverage of the pixel */
+#define DISCARD_FOR_PASS(coverage) \
+        "#if defined(OPAQUE_INTERIOR)\n" \
+        "    if (" coverage " < 1.0)\n" \
+        "        discard;\n" \
+        "#elif defined(EDGE_BAND)\n" \
+        "    if (" coverage " >= 1.0)\n" \
+        "        discard;\n" \
+        "#endif\n"
+
+/* Shader code for the start of main() that makes an OVERDRAW program output
+ * 1 for every fragment it runs for, even those that would be discarded */
+#define COUNT_OVERDRAW \
+        "#ifdef OVERDRAW\n" \
+        "    out_color = vec4(1.0);\n" \
+        "    return;\n" \
+        "#endif\n"
+
 enum {
-        SHADER_PROJECTIONS_VERT,
+        SHADER_ELLIPSE_VERT,
         SHADER_ELLIPSE_FRAG,
+        SHADER_CIRCLE_VERT,
         SHADER_CIRCLE_FRAG,
-        SHADER_TEST_VERT,
-        SHADER_TEST_FRAG,
+        SHADER_ROUNDRECT_VERT,
+        SHADER_ROUNDRECT_FRAG,
+        SHADER_SPLAT_VERT,
+        SHADER_SPLAT_FRAG,
+        SHADER_COMPOSITE_VERT,
+        SHADER_COMPOSITE_FRAG,
+        SHADER_HEATMAP_FRAG,
+        SHADER_TEXT_VERT,
+        SHADER_TEXT_FRAG,
         NUM_SHADER_KINDS,
 };
 
 enum {
         UNIFORM_ELLIPSE_projMat,
-        UNIFORM_ELLIPSE_p0,
-        UNIFORM_ELLIPSE_p1,
-        UNIFORM_ELLIPSE_radius,
-        UNIFORM_ELLIPSE_color,
+        UNIFORM_ELLIPSE_pixelsPerWorldUnit,
+        UNIFORM_ELLIPSE_depthBias,
+        UNIFORM_ELLIPSE_depthScale,
+        UNIFORM_ELLIPSE_firstOrder,
         UNIFORM_CIRCLE_projMat,
-        UNIFORM_CIRCLE_centerPoint,
-        UNIFORM_CIRCLE_radius,
-        UNIFORM_CIRCLE_color,
+        UNIFORM_CIRCLE_depthBias,
+        UNIFORM_CIRCLE_depthScale,
+        UNIFORM_CIRCLE_firstOrder,
+        UNIFORM_ROUNDRECT_projMat,
+        UNIFORM_ROUNDRECT_depthBias,
+        UNIFORM_ROUNDRECT_depthScale,
+        UNIFORM_ROUNDRECT_firstOrder,
+        UNIFORM_SPLAT_projMat,
+        UNIFORM_SPLAT_pixelsPerWorldUnit,
+        UNIFORM_SPLAT_depthBias,
+        UNIFORM_SPLAT_depthScale,
+        UNIFORM_SPLAT_firstOrder,
+        UNIFORM_COMPOSITE_destRect,
+        UNIFORM_COMPOSITE_sourceRect,
+        UNIFORM_HEATMAP_destRect,
+        UNIFORM_HEATMAP_sourceRect,
+        UNIFORM_HEATMAP_maxOverdraw,
+        UNIFORM_TEXT_projMat,
         NUM_UNIFORM_KINDS,
 };
 
 enum {
         ATTRIBUTE_ELLIPSE_position,
+        ATTRIBUTE_ELLIPSE_center,
+        ATTRIBUTE_ELLIPSE_axis,
+        ATTRIBUTE_ELLIPSE_semiAxes,
+        ATTRIBUTE_ELLIPSE_color,
+        ATTRIBUTE_ELLIPSE_strokeWidth,
+        ATTRIBUTE_ELLIPSE_strokeColor,
+        ATTRIBUTE_ELLIPSE_order,
         ATTRIBUTE_CIRCLE_position,
-        ATTRIBUTE_TEST_position,
+        ATTRIBUTE_CIRCLE_centerPoint,
+        ATTRIBUTE_CIRCLE_radius,
+        ATTRIBUTE_CIRCLE_color,
+        ATTRIBUTE_CIRCLE_strokeWidth,
+        ATTRIBUTE_CIRCLE_strokeColor,
+        ATTRIBUTE_CIRCLE_order,
+        ATTRIBUTE_ROUNDRECT_position,
+        ATTRIBUTE_ROUNDRECT_center,
+        ATTRIBUTE_ROUNDRECT_halfSize,
+        ATTRIBUTE_ROUNDRECT_cornerRadius,
+        ATTRIBUTE_ROUNDRECT_thickness,
+        ATTRIBUTE_ROUNDRECT_color,
+        ATTRIBUTE_ROUNDRECT_strokeWidth,
+        ATTRIBUTE_ROUNDRECT_strokeColor,
+        ATTRIBUTE_ROUNDRECT_order,
+        ATTRIBUTE_SPLAT_position,
+        ATTRIBUTE_SPLAT_centerPoint,
+        ATTRIBUTE_SPLAT_halfSize,
+        ATTRIBUTE_SPLAT_area,
+        ATTRIBUTE_SPLAT_color,
+        ATTRIBUTE_SPLAT_order,
+        ATTRIBUTE_COMPOSITE_position,
+        ATTRIBUTE_HEATMAP_position,
+        ATTRIBUTE_TEXT_position,
+        ATTRIBUTE_TEXT_anchor,
+        ATTRIBUTE_TEXT_offset,
+        ATTRIBUTE_TEXT_size,
+        ATTRIBUTE_TEXT_texRect,
+        ATTRIBUTE_TEXT_color,
         NUM_ATTRIBUTE_KINDS,
 };
 
@@ -61,6 +181,65 @@ struct AttributeInfo {
         const char *attributeName;
 };
 
+/* per-instance data for the ellipse program */
+struct EllipseInstance {
+        float center[2];
+        float axis[2];  // unit vector along the major axis
+        float semiAxes[2];
+        float color[3];
+        float strokeWidth;
+        float strokeColor[3];
+        float order;  // the Object, which gives the depth, see set_depth_range()
+};
+
+/* per-instance data for the circle program */
+struct CircleInstance {
+        float centerX;
+        float centerY;
+        float radius;
+        float color[3];
+        float strokeWidth;
+        float strokeColor[3];
+        float order;  // the Object, which gives the depth, see set_depth_range()
+};
+
+/* per-instance data for the rounded rectangle program */
+struct RoundRectInstance {
+        float center[2];
+        float halfSize[2];
+        float cornerRadius;
+        float thickness;
+        float color[3];
+        float strokeWidth;
+        float strokeColor[3];
+        float order;  // the Object, which gives the depth, see set_depth_range()
+};
+
+/* per-instance data for the splat program, which draws shapes that are too
+ * small on the screen to be worth the full shaders. The splat covers at
+ * least one pixel, and its alpha is the fraction of it that the area of the
+ * shape covers. Both are worked out in the shader, so the instance doesn't
+ * depend on the zoom. */
+struct SplatInstance {
+        float centerX;
+        float centerY;
+        float halfSize;
+        float area;
+        float color[3];
+        float order;
+};
+
+/* per-instance data for the text program: one glyph of a label. The label
+ * is anchored at a point in the world, and the glyphs are placed around it.
+ * The lengths are in world units, so labels zoom with the shapes. */
+struct GlyphInstance {
+        float anchor[2];
+        float offset[2];
+        float size[2];
+        float texRect[4];
+        float color[3];
+};
+
 enum {
         STATE_NORMAL,
         STATE_HOVERING,
@@ -80,51 +259,140 @@ static const float circleColors[NUM_STATES][3] = {
         { 0.9f, 0.3f, 0.2f },
 };
 
-static const struct ShaderInfo shaderInfo[NUM_SHADER_KINDS] = {
+static const float roundRectColors[NUM_STATES][3] = {
+        { 0.2f, 0.6f, 0.3f },
+        { 0.25f, 0.7f, 0.35f },
+        { 0.3f, 0.75f, 0.4f },
+};
+
+/* Shapes whose projected size (the diameter, the major axis for ellipses, or
+ * the longer side for rounded rectangles) is less than this number of pixels are drawn as splats */
+static const float lodSplatThresholdPixels = 2.0f;
+
+/* The matcap holds the lighting of a circle of this size, at this place.
+ * The lights in the circle shader are at fixed positions, so circles
+ * elsewhere look a little different when lit by the shader. */
+enum {
+        MATCAP_SIZE = 128,
+};
+static const float matcapReferenceX = 0.5f;
+static const float matcapReferenceY = 0.375f;
+static const float matcapReferenceRadius = 0.05f;
+
+/* Splatted circles don't get any lighting. This factor makes them come out
+ * at roughly the average brightness of a lit circle. */
+static const float circleSplatBrightness = 0.4f;
+
+/* Goes before the feature #defines and the shader source */
 #ifdef __EMSCRIPTEN__
-#define MAKE(shaderKind, shaderType, shaderSource) [shaderKind] = { shaderType, #shaderKind, "#version 300 es\n" "precision highp float;\n" shaderSource }
+static const char shaderPrologue[] = "#version 300 es\n" "precision highp float;\n";
 #else
-#define MAKE(shaderKind, shaderType, shaderSource) [shaderKind] = { shaderType, #shaderKind, "#version 130\n" shaderSource }
+static const char shaderPrologue[] = "#version 330 core\n";
 #endif
-        MAKE(SHADER_PROJECTIONS_VERT, SHADER_VERTEX,
+
+static const struct ShaderInfo shaderInfo[NUM_SHADER_KINDS] = {
+#define MAKE(shaderKind, shaderType, shaderSource) [shaderKind] = { shaderType, #shaderKind, shaderSource }
+        MAKE(SHADER_ELLIPSE_VERT, SHADER_VERTEX,
                 "uniform mat3 projMat;\n"
-                "vec4 compute_screenpos(vec2 position)\n"
-                "{\n"
-                "    vec3 v = projMat * vec3(position, 1.0);\n"
-                "    return vec4(v.xy, 0.0, 1.0);\n"
-                "}\n"
-                "in vec2 position;\n"
-                "out vec2 positionF;\n"
+                "uniform float pixelsPerWorldUnit;\n"
+                "uniform float depthBias;\n"
+                "uniform float depthScale;\n"
+                "uniform float firstOrder;\n"
+                "in vec2 position;\n"  // corner of the unit quad
+                "in vec2 center;\n"
+                "in vec2 axis;\n"
+                "in vec2 semiAxes;\n"
+                "in vec3 color;\n"
+                "in float strokeWidth;\n"
+                "in vec3 strokeColor;\n"
+                "in float order;\n"
+                "out vec2 unitPositionF;\n"
+                "flat out vec2 gradientScaleF;\n"
+                "flat out vec3 colorF;\n"
+                "flat out float strokeWidthF;\n"  // in pixels
+                "flat out vec3 strokeColorF;\n"
                 "void main()\n"
                 "{\n"
-                "    positionF = position;\n"
-                "    gl_Position = compute_screenpos(position);\n"
+                /* The bounding quad is oriented along the major axis. In the
+                 * fragment shader, the ellipse is the unit circle in quad
+                 * coordinates, and gradientScaleF takes the gradient from
+                 * quad coordinates to pixels. */
+                "    vec2 v = vec2(-axis.y, axis.x);\n"
+                "    vec2 positionW = center + position.x * semiAxes.x * axis + position.y * semiAxes.y * v;\n"
+                "    unitPositionF = position;\n"
+                "    gradientScaleF = 1.0 / (semiAxes * pixelsPerWorldUnit);\n"
+                "    colorF = color;\n"
+                "    strokeWidthF = strokeWidth * pixelsPerWorldUnit;\n"
+                "    strokeColorF = strokeColor;\n"
+                "    vec3 w = projMat * vec3(positionW, 1.0);\n"
+                "    gl_Position = vec4(w.xy, depthBias + depthScale * (order - firstOrder), 1.0);\n"
                 "}\n"),
         MAKE(SHADER_ELLIPSE_FRAG, SHADER_FRAGMENT,
-                "uniform vec2 p0;\n"
-                "uniform vec2 p1;\n"
-                "uniform float radius;\n"
-                "uniform vec3 color;\n"
-                "in vec2 positionF;\n"
+                "in vec2 unitPositionF;\n"
+                "flat in vec2 gradientScaleF;\n"
+                "flat in vec3 colorF;\n"
+                "flat in float strokeWidthF;\n"
+                "flat in vec3 strokeColorF;\n"
                 "out vec4 out_color;\n"
                 "void main()\n"
                 "{\n"
-                "    float d0 = distance(p0.xy, positionF);\n"
-                "    float d1 = distance(p1.xy, positionF);\n"
-                "    float d = d0 + d1;\n"
-                "    float rdx = fwidth(d);\n"
-                "    if (d > radius)\n"
+                /* f is the implicit function of the unit circle. Dividing by
+                 * the length of its gradient gives the (signed) distance
+                 * to the edge in pixels. */
+                COUNT_OVERDRAW
+                "    float f = dot(unitPositionF, unitPositionF) - 1.0;\n"
+                "    if (f > 0.0)\n"
                 "        discard;\n"
-                "    float val = (d - (radius - rdx)) / rdx;\n"
-                "    out_color = vec4(color, 1.0 - val);\n"
+                "    vec2 gradient = 2.0 * unitPositionF * gradientScaleF;\n"
+                "    float d = f / max(length(gradient), 1e-6);\n"
+                "    float coverage = min(-d, 1.0);\n"
+                DISCARD_FOR_PASS("coverage")
+                /* the stroke is the band of the given width inside the
+                 * edge, antialiased against the fill over one pixel */
+                "    float strokeAmount = clamp(strokeWidthF + d, 0.0, 1.0);\n"
+                "    out_color = vec4(mix(colorF, strokeColorF, strokeAmount), coverage);\n"
                 "}\n"),
-        MAKE(SHADER_CIRCLE_FRAG, SHADER_FRAGMENT,
+        MAKE(SHADER_CIRCLE_VERT, SHADER_VERTEX,
                 "uniform mat3 projMat;\n"
-                "uniform vec2 centerPoint;\n"
-                "uniform float radius;\n"
-                "uniform vec3 color;\n"
+                "uniform float depthBias;\n"
+                "uniform float depthScale;\n"
+                "uniform float firstOrder;\n"
+                "in vec2 position;\n"  // corner of the unit quad
+                "in vec2 centerPoint;\n"
+                "in float radius;\n"
+                "in vec3 color;\n"
+                "in float strokeWidth;\n"
+                "in vec3 strokeColor;\n"
+                "in float order;\n"
+                "out vec2 positionF;\n"
+                "flat out vec2 centerPointF;\n"
+                "flat out float radiusF;\n"
+                "flat out vec3 colorF;\n"
+                "flat out float strokeWidthF;\n"
+                "flat out vec3 strokeColorF;\n"
+                "void main()\n"
+                "{\n"
+                "    positionF = centerPoint + radius * position;\n"
+                "    centerPointF = centerPoint;\n"
+                "    radiusF = radius;\n"
+                "    colorF = color;\n"
+                "    strokeWidthF = strokeWidth;\n"
+                "    strokeColorF = strokeColor;\n"
+                "    vec3 v = projMat * vec3(positionF, 1.0);\n"
+                "    gl_Position = vec4(v.xy, depthBias + depthScale * (order - firstOrder), 1.0);\n"
+                "}\n"),
+        MAKE(SHADER_CIRCLE_FRAG, SHADER_FRAGMENT,
+                "#ifdef MATCAP\n"
+                "uniform sampler2D matcap;\n"
+                "#endif\n"
                 "in vec2 positionF;\n"
+                "flat in vec2 centerPointF;\n"
+                "flat in float radiusF;\n"
+                "flat in vec3 colorF;\n"
+                "flat in float strokeWidthF;\n"
+                "flat in vec3 strokeColorF;\n"
                 "out vec4 out_color;\n"
+                "#ifndef MATCAP\n"
                 "float compute_specular_strength(vec3 lightPos, vec3 surfacePoint, vec3 normalizedSurfaceNormal, vec3 spectatorPosition) {\n"
                 "    vec3 lightToSurface = surfacePoint - lightPos;\n"
                 "    vec3 reflectVector = normalize(lightToSurface - 2.0 * dot(lightToSurface, normalizedSurfaceNormal) * normalizedSurfaceNormal);\n"
@@ -132,17 +400,30 @@ static const struct ShaderInfo shaderInfo[NUM_SHADER_KINDS] = {
                 "    float strength = pow(clamp(dot(reflectVector, spectateDirection), 0.0, 1.0), 4.0);\n"
                 "    return strength;\n"
                 "}\n"
+                "#endif\n"
                 "void main()\n"
                 "{\n"
-                "    float d = distance(positionF, centerPoint);\n"
-                "    if (d > radius)\n"
+                COUNT_OVERDRAW
+                "    float d = distance(positionF, centerPointF);\n"
+                "    if (d > radiusF)\n"
                 "        discard;\n"
+                "    float rdx = fwidth(d);\n"
+                "    float val = (d - (radiusF - rdx)) / rdx;\n"
+                DISCARD_FOR_PASS("1.0 - val")
+                /* The matcap has the specular color in rgb and the diffuse
+                 * strength in alpha, see make_matcap() */
+                "#if defined(FLAT)\n"
+                "    vec3 fill = 0.4 * colorF;\n"  // about the average lighting
+                "#elif defined(MATCAP)\n"
+                "    vec4 m = texture(matcap, 0.5 + 0.5 * (positionF - centerPointF) / radiusF);\n"
+                "    vec3 fill = m.a * colorF + m.rgb;\n"
+                "#else\n"
                 /* Find height h which is the y-component such that vec3(positionF, h) is on the surface of the circle ("ball"). */
                 /* That means that h must be such that h^2 + d^2 = radius^2 */
-                "    float h = sqrt(radius * radius - d * d);\n"
+                "    float h = sqrt(radiusF * radiusF - d * d);\n"
                 "    vec3 surfacePoint = vec3(positionF, h);\n"
-                "    vec3 centerToSurface = surfacePoint - vec3(centerPoint, 0.0);\n"
-                "    vec3 lightPos = vec3(0.2, 0.5, 5.0*radius);\n"
+                "    vec3 centerToSurface = surfacePoint - vec3(centerPointF, 0.0);\n"
+                "    vec3 lightPos = vec3(0.2, 0.5, 5.0*radiusF);\n"
                 "    vec3 lightPos2 = vec3(1.0, 1.0, 1.0);\n"
                 "    vec3 surfaceToLight = lightPos - vec3(positionF, h);\n"
                 "    vec3 spectatorPosition = vec3(0.5, 0.5, 6.0);\n"  // center of screen
@@ -154,116 +435,629 @@ static const struct ShaderInfo shaderInfo[NUM_SHADER_KINDS] = {
                 "    float specularStrength = compute_specular_strength(lightPos, surfacePoint, surfaceNormal, spectatorPosition);\n"
                 "    float specularStrength2 = compute_specular_strength(lightPos2, surfacePoint, surfaceNormal, spectatorPosition);\n"
 
-                /* smooth shape at the edges */
-                "    float rdx = fwidth(d);\n"
-                "    float val = (d - (radius - rdx)) / rdx;\n"
-
                 " vec3 specularLight = vec3(0.0, 1.0, 1.0);\n"
                 " vec3 specularLight2 = vec3(0.3, 0.0, 0.6);\n"
                 " vec3 specularColor = 0.5 * specularStrength * specularLight;\n"
                 " vec3 specularColor2 = 0.5 * specularStrength2 * specularLight2;\n"
                 "    float strength = 0.1 + 0.3 * diffuseStrength;\n"
-                "    out_color = vec4(strength * color + (specularColor + specularColor2), 1.0 - val);\n"
+                "    vec3 fill = strength * colorF + (specularColor + specularColor2);\n"
+                "#endif\n"
+                /* d and rdx are in world units, like the stroke width */
+                "    float strokeAmount = clamp((strokeWidthF - (radiusF - d)) / rdx, 0.0, 1.0);\n"
+                "    out_color = vec4(mix(fill, strokeColorF, strokeAmount), 1.0 - val);\n"
                 "}\n"),
-        MAKE(SHADER_TEST_VERT, SHADER_VERTEX,
-                "in vec2 position;\n"
-                "out vec2 p;\n"
+        MAKE(SHADER_ROUNDRECT_VERT, SHADER_VERTEX,
+                "uniform mat3 projMat;\n"
+                "uniform float depthBias;\n"
+                "uniform float depthScale;\n"
+                "uniform float firstOrder;\n"
+                "in vec2 position;\n"  // corner of the unit quad
+                "in vec2 center;\n"
+                "in vec2 halfSize;\n"
+                "in float cornerRadius;\n"
+                "in float thickness;\n"
+                "in vec3 color;\n"
+                "in float strokeWidth;\n"
+                "in vec3 strokeColor;\n"
+                "in float order;\n"
+                "out vec2 positionF;\n"
+                "flat out vec2 centerF;\n"
+                "flat out vec2 halfSizeF;\n"
+                "flat out float cornerRadiusF;\n"
+                "flat out float thicknessF;\n"
+                "flat out vec3 colorF;\n"
+                "flat out float strokeWidthF;\n"
+                "flat out vec3 strokeColorF;\n"
                 "void main()\n"
                 "{\n"
-                "    p = position;\n"
-                "    gl_Position = vec4(position, 0.0, 1.0);\n"
+                "    positionF = center + halfSize * position;\n"
+                "    centerF = center;\n"
+                "    halfSizeF = halfSize;\n"
+                "    cornerRadiusF = cornerRadius;\n"
+                "    thicknessF = thickness;\n"
+                "    colorF = color;\n"
+                "    strokeWidthF = strokeWidth;\n"
+                "    strokeColorF = strokeColor;\n"
+                "    vec3 v = projMat * vec3(positionF, 1.0);\n"
+                "    gl_Position = vec4(v.xy, depthBias + depthScale * (order - firstOrder), 1.0);\n"
                 "}\n"),
-        MAKE(SHADER_TEST_FRAG, SHADER_FRAGMENT,
-                "in vec2 p;\n"
+        MAKE(SHADER_ROUNDRECT_FRAG, SHADER_FRAGMENT,
+                "in vec2 positionF;\n"
+                "flat in vec2 centerF;\n"
+                "flat in vec2 halfSizeF;\n"
+                "flat in float cornerRadiusF;\n"
+                "flat in float thicknessF;\n"
+                "flat in vec3 colorF;\n"
+                "flat in float strokeWidthF;\n"
+                "flat in vec3 strokeColorF;\n"
                 "out vec4 out_color;\n"
-                "float square(float x) { return x * x; }\n"
                 "void main()\n"
                 "{\n"
-                "    vec4 bgColor = vec4(1.0, 0.0, 0.0, 1.0);\n"
-                "    vec4 fgColor = vec4(0.0, 1.0, 0.0, 1.0);\n"
-                "    float thickness = 0.05;\n"
-                "    float r = 0.2;\n"
-                "    float cx = 0.0;\n"
-                "    float cy = 0.0;\n"
-                "    float w = 0.5;\n"
-                "    float h = 0.3;\n"
-                "    float dx = abs(cx - p.x);\n"
-                "    float dy = abs(cy - p.y);\n"
-                "    float rdx = fwidth(p.x);\n"
-                "    if ((w - r <= dx && dx < w)\n"
-                "        && (h - r <= dy && dy < h)) {\n"
-                "        float d = distance(vec2(dx, dy), vec2(w - r, h - r));\n"
-                "        if (d > r - thickness / 2.0) {\n"
-                "            float val = (d - (r - rdx)) / rdx;\n"
-                "            out_color = vec4(fgColor.rgb, 1.0 - val);\n"
-                "        }\n"
-                "        else {\n"
-                "            float val = (d - (r - thickness)) / rdx;\n"
-                "            out_color = vec4(fgColor.rgb, val);\n"
-                "        }\n"
-                "    }\n"
-                "    else {\n"
-                "        float d = max(dx - (w - thickness), dy - (h - thickness));\n"
-                "        if (d > thickness / 2.0) {\n"
-                "            float val = (d - (thickness - rdx)) / rdx;\n"
-                "            out_color = vec4(fgColor.rgb, 1.0 - val);\n"
-                "        }\n"
-                "        else {\n"
-                "            float val = d / rdx;\n"
-                "            out_color = vec4(fgColor.rgb, val);\n"
-                "        }\n"
+                COUNT_OVERDRAW
+                /* d is the signed distance to the outer edge, in world
+                 * units. The outline is where -thicknessF < d < 0, and both
+                 * of its edges get antialiased over one pixel. */
+                "    vec2 q = abs(positionF - centerF) - (halfSizeF - cornerRadiusF);\n"
+                "    float d = length(max(q, 0.0)) + min(max(q.x, q.y), 0.0) - cornerRadiusF;\n"
+                "    if (d > 0.0 || d < -thicknessF)\n"
+                "        discard;\n"
+                "    float rdx = fwidth(positionF.x);\n"
+                "    float coverage = min(min(-d, d + thicknessF) / rdx, 1.0);\n"
+                DISCARD_FOR_PASS("coverage")
+                "    float strokeAmount = clamp((strokeWidthF + d) / rdx, 0.0, 1.0);\n"
+                "    out_color = vec4(mix(colorF, strokeColorF, strokeAmount), coverage);\n"
+                "}\n"),
+        MAKE(SHADER_SPLAT_VERT, SHADER_VERTEX,
+                "uniform mat3 projMat;\n"
+                "uniform float pixelsPerWorldUnit;\n"
+                "uniform float depthBias;\n"
+                "uniform float depthScale;\n"
+                "uniform float firstOrder;\n"
+                "in vec2 position;\n"  // corner of the unit quad
+                "in vec2 centerPoint;\n"
+                "in float halfSize;\n"
+                "in float area;\n"
+                "in vec3 color;\n"
+                "in float order;\n"
+                "flat out vec4 colorF;\n"
+                "void main()\n"
+                "{\n"
+                "    float h = max(halfSize, 0.5 / pixelsPerWorldUnit);\n"
+                "    colorF = vec4(color, min(area / (4.0 * h * h), 1.0));\n"
+                "    vec3 v = projMat * vec3(centerPoint + h * position, 1.0);\n"
+                "    gl_Position = vec4(v.xy, depthBias + depthScale * (order - firstOrder), 1.0);\n"
+                "}\n"),
+        MAKE(SHADER_SPLAT_FRAG, SHADER_FRAGMENT,
+                "flat in vec4 colorF;\n"
+                "out vec4 out_color;\n"
+                "void main()\n"
+                "{\n"
+                COUNT_OVERDRAW
+                "    out_color = colorF;\n"
+                "}\n"),
+        MAKE(SHADER_COMPOSITE_VERT, SHADER_VERTEX,
+                "uniform vec4 destRect;\n"  // in clip space
+                "uniform vec4 sourceRect;\n"  // in texture coordinates
+                "in vec2 position;\n"  // corner of the unit quad
+                "out vec2 texCoordF;\n"
+                "void main()\n"
+                "{\n"
+                "    vec2 t = 0.5 * position + 0.5;\n"
+                "    texCoordF = mix(sourceRect.xy, sourceRect.zw, t);\n"
+                "    gl_Position = vec4(mix(destRect.xy, destRect.zw, t), 0.0, 1.0);\n"
+                "}\n"),
+        MAKE(SHADER_COMPOSITE_FRAG, SHADER_FRAGMENT,
+                "uniform sampler2D tex;\n"
+                "in vec2 texCoordF;\n"
+                "out vec4 out_color;\n"
+                "void main()\n"
+                "{\n"
+                "    out_color = texture(tex, texCoordF);\n"
+                "}\n"),
+        MAKE(SHADER_HEATMAP_FRAG, SHADER_FRAGMENT,
+                "uniform sampler2D tex;\n"  // fragment counts in the red channel
+                "uniform float maxOverdraw;\n"
+                "in vec2 texCoordF;\n"
+                "out vec4 out_color;\n"
+                "void main()\n"
+                "{\n"
+                "    float n = texture(tex, texCoordF).r;\n"
+                "    if (n < 0.5) {\n"
+                "        out_color = vec4(0.0, 0.0, 0.0, 1.0);\n"
+                "        return;\n"
                 "    }\n"
+                /* blue for a single fragment, through green and yellow to
+                 * red for maxOverdraw */
+                "    float t = clamp((n - 1.0) / max(maxOverdraw - 1.0, 1.0), 0.0, 1.0);\n"
+                "    vec3 c = clamp(1.5 - abs(4.0 * t - vec3(3.0, 2.0, 1.0)), 0.0, 1.0);\n"
+                "    out_color = vec4(c, 1.0);\n"
+                "}\n"),
+        MAKE(SHADER_TEXT_VERT, SHADER_VERTEX,
+                "uniform mat3 projMat;\n"
+                "in vec2 position;\n"  // corner of the unit quad
+                "in vec2 anchor;\n"
+                "in vec2 offset;\n"  // of the lower left corner from the anchor
+                "in vec2 size;\n"
+                "in vec4 texRect;\n"
+                "in vec3 color;\n"
+                "out vec2 texCoordF;\n"
+                "flat out vec3 colorF;\n"
+                "void main()\n"
+                "{\n"
+                "    vec2 t = 0.5 * position + 0.5;\n"
+                "    texCoordF = mix(texRect.xy, texRect.zw, t);\n"
+                "    colorF = color;\n"
+                "    vec3 v = projMat * vec3(anchor + offset + t * size, 1.0);\n"
+                "    gl_Position = vec4(v.xy, 0.0, 1.0);\n"
+                "}\n"),
+        MAKE(SHADER_TEXT_FRAG, SHADER_FRAGMENT,
+                "uniform sampler2D atlas;\n"  // signed distance fields in the red channel, see text.h
+                "in vec2 texCoordF;\n"
+                "flat in vec3 colorF;\n"
+                "out vec4 out_color;\n"
+                "void main()\n"
+                "{\n"
+                /* antialias over about one pixel, whatever the zoom */
+                "    float d = texture(atlas, texCoordF).r;\n"
+                "    float w = 0.5 * fwidth(d);\n"
+                "    out_color = vec4(colorF, smoothstep(0.5 - w, 0.5 + w, d));\n"
                 "}\n"),
 #undef MAKE
 };
 
 static const struct LinkInfo linkInfo[] = {
-        { PROGRAM_ELLIPSE, SHADER_PROJECTIONS_VERT },
-        { PROGRAM_CIRCLE, SHADER_PROJECTIONS_VERT },
+        { PROGRAM_ELLIPSE, SHADER_ELLIPSE_VERT },
+        { PROGRAM_CIRCLE, SHADER_CIRCLE_VERT },
         { PROGRAM_ELLIPSE, SHADER_ELLIPSE_FRAG },
         { PROGRAM_CIRCLE, SHADER_CIRCLE_FRAG },
-        { PROGRAM_TEST, SHADER_TEST_FRAG },
-        { PROGRAM_TEST, SHADER_TEST_VERT },
+        { PROGRAM_ROUNDRECT, SHADER_ROUNDRECT_VERT },
+        { PROGRAM_ROUNDRECT, SHADER_ROUNDRECT_FRAG },
+        { PROGRAM_SPLAT, SHADER_SPLAT_VERT },
+        { PROGRAM_SPLAT, SHADER_SPLAT_FRAG },
+        { PROGRAM_COMPOSITE, SHADER_COMPOSITE_VERT },
+        { PROGRAM_COMPOSITE, SHADER_COMPOSITE_FRAG },
+        { PROGRAM_HEATMAP, SHADER_COMPOSITE_VERT },
+        { PROGRAM_HEATMAP, SHADER_HEATMAP_FRAG },
+        { PROGRAM_TEXT, SHADER_TEXT_VERT },
+        { PROGRAM_TEXT, SHADER_TEXT_FRAG },
 };
 
 static const struct UniformInfo uniformInfo[NUM_UNIFORM_KINDS] = {
 #define MAKE(x, y, z) [y] = { x, z }
         MAKE( PROGRAM_ELLIPSE, UNIFORM_ELLIPSE_projMat, "projMat" ),
-        MAKE( PROGRAM_ELLIPSE, UNIFORM_ELLIPSE_p0, "p0" ),
-        MAKE( PROGRAM_ELLIPSE, UNIFORM_ELLIPSE_p1, "p1" ),
-        MAKE( PROGRAM_ELLIPSE, UNIFORM_ELLIPSE_radius, "radius" ),
-        MAKE( PROGRAM_ELLIPSE, UNIFORM_ELLIPSE_color, "color" ),
+        MAKE( PROGRAM_ELLIPSE, UNIFORM_ELLIPSE_pixelsPerWorldUnit, "pixelsPerWorldUnit" ),
+        MAKE( PROGRAM_ELLIPSE, UNIFORM_ELLIPSE_depthBias, "depthBias" ),
+        MAKE( PROGRAM_ELLIPSE, UNIFORM_ELLIPSE_depthScale, "depthScale" ),
+        MAKE( PROGRAM_ELLIPSE, UNIFORM_ELLIPSE_firstOrder, "firstOrder" ),
         MAKE( PROGRAM_CIRCLE, UNIFORM_CIRCLE_projMat, "projMat" ),
-        MAKE( PROGRAM_CIRCLE, UNIFORM_CIRCLE_centerPoint, "centerPoint" ),
-        MAKE( PROGRAM_CIRCLE, UNIFORM_CIRCLE_radius, "radius" ),
-        MAKE( PROGRAM_CIRCLE, UNIFORM_CIRCLE_color, "color" ),
+        MAKE( PROGRAM_CIRCLE, UNIFORM_CIRCLE_depthBias, "depthBias" ),
+        MAKE( PROGRAM_CIRCLE, UNIFORM_CIRCLE_depthScale, "depthScale" ),
+        MAKE( PROGRAM_CIRCLE, UNIFORM_CIRCLE_firstOrder, "firstOrder" ),
+        MAKE( PROGRAM_ROUNDRECT, UNIFORM_ROUNDRECT_projMat, "projMat" ),
+        MAKE( PROGRAM_ROUNDRECT, UNIFORM_ROUNDRECT_depthBias, "depthBias" ),
+        MAKE( PROGRAM_ROUNDRECT, UNIFORM_ROUNDRECT_depthScale, "depthScale" ),
+        MAKE( PROGRAM_ROUNDRECT, UNIFORM_ROUNDRECT_firstOrder, "firstOrder" ),
+        MAKE( PROGRAM_SPLAT, UNIFORM_SPLAT_projMat, "projMat" ),
+        MAKE( PROGRAM_SPLAT, UNIFORM_SPLAT_pixelsPerWorldUnit, "pixelsPerWorldUnit" ),
+        MAKE( PROGRAM_SPLAT, UNIFORM_SPLAT_depthBias, "depthBias" ),
+        MAKE( PROGRAM_SPLAT, UNIFORM_SPLAT_depthScale, "depthScale" ),
+        MAKE( PROGRAM_SPLAT, UNIFORM_SPLAT_firstOrder, "firstOrder" ),
+        MAKE( PROGRAM_COMPOSITE, UNIFORM_COMPOSITE_destRect, "destRect" ),
+        MAKE( PROGRAM_COMPOSITE, UNIFORM_COMPOSITE_sourceRect, "sourceRect" ),
+        MAKE( PROGRAM_HEATMAP, UNIFORM_HEATMAP_destRect, "destRect" ),
+        MAKE( PROGRAM_HEATMAP, UNIFORM_HEATMAP_sourceRect, "sourceRect" ),
+        MAKE( PROGRAM_HEATMAP, UNIFORM_HEATMAP_maxOverdraw, "maxOverdraw" ),
+        MAKE( PROGRAM_TEXT, UNIFORM_TEXT_projMat, "projMat" ),
 #undef MAKE
 };
 
 static const struct AttributeInfo attributeInfo[NUM_ATTRIBUTE_KINDS] = {
 #define MAKE(x, y, z) [y] = { x, z }
         MAKE( PROGRAM_ELLIPSE, ATTRIBUTE_ELLIPSE_position, "position" ),
+        MAKE( PROGRAM_ELLIPSE, ATTRIBUTE_ELLIPSE_center, "center" ),
+        MAKE( PROGRAM_ELLIPSE, ATTRIBUTE_ELLIPSE_axis, "axis" ),
+        MAKE( PROGRAM_ELLIPSE, ATTRIBUTE_ELLIPSE_semiAxes, "semiAxes" ),
+        MAKE( PROGRAM_ELLIPSE, ATTRIBUTE_ELLIPSE_color, "color" ),
+        MAKE( PROGRAM_ELLIPSE, ATTRIBUTE_ELLIPSE_strokeWidth, "strokeWidth" ),
+        MAKE( PROGRAM_ELLIPSE, ATTRIBUTE_ELLIPSE_strokeColor, "strokeColor" ),
+        MAKE( PROGRAM_ELLIPSE, ATTRIBUTE_ELLIPSE_order, "order" ),
         MAKE( PROGRAM_CIRCLE, ATTRIBUTE_CIRCLE_position, "position" ),
-        MAKE( PROGRAM_TEST, ATTRIBUTE_TEST_position, "position" ),
+        MAKE( PROGRAM_CIRCLE, ATTRIBUTE_CIRCLE_centerPoint, "centerPoint" ),
+        MAKE( PROGRAM_CIRCLE, ATTRIBUTE_CIRCLE_radius, "radius" ),
+        MAKE( PROGRAM_CIRCLE, ATTRIBUTE_CIRCLE_color, "color" ),
+        MAKE( PROGRAM_CIRCLE, ATTRIBUTE_CIRCLE_strokeWidth, "strokeWidth" ),
+        MAKE( PROGRAM_CIRCLE, ATTRIBUTE_CIRCLE_strokeColor, "strokeColor" ),
+        MAKE( PROGRAM_CIRCLE, ATTRIBUTE_CIRCLE_order, "order" ),
+        MAKE( PROGRAM_ROUNDRECT, ATTRIBUTE_ROUNDRECT_position, "position" ),
+        MAKE( PROGRAM_ROUNDRECT, ATTRIBUTE_ROUNDRECT_center, "center" ),
+        MAKE( PROGRAM_ROUNDRECT, ATTRIBUTE_ROUNDRECT_halfSize, "halfSize" ),
+        MAKE( PROGRAM_ROUNDRECT, ATTRIBUTE_ROUNDRECT_cornerRadius, "cornerRadius" ),
+        MAKE( PROGRAM_ROUNDRECT, ATTRIBUTE_ROUNDRECT_thickness, "thickness" ),
+        MAKE( PROGRAM_ROUNDRECT, ATTRIBUTE_ROUNDRECT_color, "color" ),
+        MAKE( PROGRAM_ROUNDRECT, ATTRIBUTE_ROUNDRECT_strokeWidth, "strokeWidth" ),
+        MAKE( PROGRAM_ROUNDRECT, ATTRIBUTE_ROUNDRECT_strokeColor, "strokeColor" ),
+        MAKE( PROGRAM_ROUNDRECT, ATTRIBUTE_ROUNDRECT_order, "order" ),
+        MAKE( PROGRAM_SPLAT, ATTRIBUTE_SPLAT_position, "position" ),
+        MAKE( PROGRAM_SPLAT, ATTRIBUTE_SPLAT_centerPoint, "centerPoint" ),
+        MAKE( PROGRAM_SPLAT, ATTRIBUTE_SPLAT_halfSize, "halfSize" ),
+        MAKE( PROGRAM_SPLAT, ATTRIBUTE_SPLAT_area, "area" ),
+        MAKE( PROGRAM_SPLAT, ATTRIBUTE_SPLAT_color, "color" ),
+        MAKE( PROGRAM_SPLAT, ATTRIBUTE_SPLAT_order, "order" ),
+        MAKE( PROGRAM_COMPOSITE, ATTRIBUTE_COMPOSITE_position, "position" ),
+        MAKE( PROGRAM_HEATMAP, ATTRIBUTE_HEATMAP_position, "position" ),
+        MAKE( PROGRAM_TEXT, ATTRIBUTE_TEXT_position, "position" ),
+        MAKE( PROGRAM_TEXT, ATTRIBUTE_TEXT_anchor, "anchor" ),
+        MAKE( PROGRAM_TEXT, ATTRIBUTE_TEXT_offset, "offset" ),
+        MAKE( PROGRAM_TEXT, ATTRIBUTE_TEXT_size, "size" ),
+        MAKE( PROGRAM_TEXT, ATTRIBUTE_TEXT_texRect, "texRect" ),
+        MAKE( PROGRAM_TEXT, ATTRIBUTE_TEXT_color, "color" ),
 #undef MAKE
 };
 
-// two triangles covering the whole screen
-static const struct Vec2 screenVerts[] = {
-        { 0.0f, 0.0f },
-        { 0.0f, 1.0f },
-        { 1.0f, 1.0f },
-        { 0.0f, 0.0f },
-        { 1.0f, 0.0f },
-        { 1.0f, 1.0f },
+// two triangles covering the square (-1,-1) x (1,1). Instanced shapes scale
+// this to their bounding quad in the vertex shader.
+static const struct Vec2 unitQuadVerts[] = {
+        { -1.0f, -1.0f }, { -1.0f, 1.0f }, { 1.0f, 1.0f },
+        { -1.0f, -1.0f }, { 1.0f, 1.0f }, { 1.0f, -1.0f },
+};
+
+/* A program kind compiled with a set of features. Variants get compiled when
+ * the first draw that uses them is submitted. All variants of a program kind
+ * bind their attributes to the same locations, so they can share VAOs. */
+struct ProgramVariant {
+        int programKind;
+        int features;  // OR'ed (1 << SHADERFEATURE_??)
+        GfxProgram gfxProgram;
+        UniformLocation uniformLocation[NUM_UNIFORM_KINDS];  // only those of programKind
+};
+
+/* Draws get recorded with a program key, which holds the program kind and
+ * the features. The variant is only looked up when the commands are
+ * submitted, so recording doesn't compile anything. */
+enum {
+        PROGRAM_KEY_FEATURES_SHIFT = 3,  // enough bits for NUM_PROGRAM_KINDS
+        NUM_PROGRAM_KEYS = 1 << (PROGRAM_KEY_FEATURES_SHIFT + NUM_SHADERFEATURE_KINDS),
+};
+
+enum {
+        MAX_PROGRAM_VARIANTS = 32,
 };
 
-static GfxShader gfxShader[NUM_SHADER_KINDS];
-static GfxProgram gfxProgram[NUM_PROGRAM_KINDS];
-static UniformLocation uniformLocation[NUM_UNIFORM_KINDS];
+static struct ProgramVariant programVariants[MAX_PROGRAM_VARIANTS];
+static int numProgramVariants;
+static unsigned char variantOfProgramKey[NUM_PROGRAM_KEYS];  // 1 + index into programVariants, or 0 if not compiled yet
 static AttributeLocation attributeLocation[NUM_ATTRIBUTE_KINDS];
 static GfxVAO gfxVaoOfProgram[NUM_PROGRAM_KINDS];
-static GfxVBO gfxVBO;
+static GfxVBO unitQuadVBO;
+
+/* instance data for the visible objects. Rebuilt every frame */
+static struct EllipseInstance *ellipseInstances;
+static struct CircleInstance *circleInstances;
+static struct RoundRectInstance *roundRectInstances;
+static struct SplatInstance *splatInstances;
+static int numEllipseInstances;
+static int numCircleInstances;
+static int numRoundRectInstances;
+static int numSplatInstances;
+static int instancesCapacity;
+
+static float pixelsPerWorldUnit;
+
+static GfxTexture matcapTexture;
+
+/* Which instance buffer an object is drawn from */
+enum {
+        INSTANCE_NONE,
+        INSTANCE_ELLIPSE,
+        INSTANCE_CIRCLE,
+        INSTANCE_ROUNDRECT,
+        INSTANCE_SPLAT,
+        NUM_INSTANCE_KINDS,
+};
+
+/* Each instance has a depth, so that the opaque pass of draw_scene() can
+ * reject hidden pixels with the depth test. Nearer instances are those that
+ * are drawn later: rounded rectangles are over all ellipses, splats are over
+ * both, and circles are over all splats. Within a rank, objects with a higher
+ * index are nearer. */
+enum {
+        DEPTHRANK_ELLIPSE,
+        DEPTHRANK_ROUNDRECT,
+        DEPTHRANK_SPLAT,
+        DEPTHRANK_CIRCLE,
+        NUM_DEPTHRANKS,
+};
+
+/* How the instances of a kind get drawn */
+struct InstanceKindInfo {
+        int programKind;
+        int instanceSize;
+        int depthRank;
+        int projMatUniform;
+        int depthBiasUniform;
+        int depthScaleUniform;
+        int firstOrderUniform;
+        int pixelsPerWorldUnitUniform;  // -1 if the program doesn't need it
+};
+
+static const struct InstanceKindInfo instanceKindInfo[NUM_INSTANCE_KINDS] = {
+        [INSTANCE_ELLIPSE] = { PROGRAM_ELLIPSE, sizeof(struct EllipseInstance), DEPTHRANK_ELLIPSE,
+                UNIFORM_ELLIPSE_projMat, UNIFORM_ELLIPSE_depthBias, UNIFORM_ELLIPSE_depthScale, UNIFORM_ELLIPSE_firstOrder, UNIFORM_ELLIPSE_pixelsPerWorldUnit },
+        [INSTANCE_CIRCLE] = { PROGRAM_CIRCLE, sizeof(struct CircleInstance), DEPTHRANK_CIRCLE,
+                UNIFORM_CIRCLE_projMat, UNIFORM_CIRCLE_depthBias, UNIFORM_CIRCLE_depthScale, UNIFORM_CIRCLE_firstOrder, -1 },
+        [INSTANCE_ROUNDRECT] = { PROGRAM_ROUNDRECT, sizeof(struct RoundRectInstance), DEPTHRANK_ROUNDRECT,
+                UNIFORM_ROUNDRECT_projMat, UNIFORM_ROUNDRECT_depthBias, UNIFORM_ROUNDRECT_depthScale, UNIFORM_ROUNDRECT_firstOrder, -1 },
+        [INSTANCE_SPLAT] = { PROGRAM_SPLAT, sizeof(struct SplatInstance), DEPTHRANK_SPLAT,
+                UNIFORM_SPLAT_projMat, UNIFORM_SPLAT_depthBias, UNIFORM_SPLAT_depthScale, UNIFORM_SPLAT_firstOrder, UNIFORM_SPLAT_pixelsPerWorldUnit },
+};
+
+/* Persistent copy of the instance data of all objects, on the CPU and on the
+ * GPU. Ellipses, circles and rounded rectangles each have a buffer of their
+ * own, where the objects of that kind get slots in the order they were
+ * added. The splat buffer has a slot for every object, at its index. The
+ * level of detail is not part of the data: every object has an instance in
+ * the buffer of its kind and one in the splat buffer, and the draws pick one
+ * of them by the projected size (see get_object_lod()). Nor is the depth,
+ * which comes from uniforms. So adding objects only appends slots, changes
+ * only patch the slots of the dirty objects, and zooming uploads nothing. */
+struct InstanceMirror {
+        void *data;
+        int numSlots;
+        int capacity;  // in slots, on the CPU and on the GPU
+        int isFullUploadNeeded;  // because the capacity changed
+        GfxVBO gfxVBO;
+        GfxVAO gfxVAO;
+};
+
+static struct InstanceMirror instanceMirrors[NUM_INSTANCE_KINDS];
+static unsigned char *mirrorKindOfObject;  // the buffer of the object's kind
+static int *mirrorSlotOfObject;  // in that buffer
+static float *mirrorSizeOfObject;  // projected size in world units, negative if there is nothing to draw
+static int numMirroredObjects;
+static int mirrorObjectsCapacity;
+
+/* The slots that were written since the last upload */
+struct MirrorSlot {
+        int instanceKind;
+        int slot;
+};
+
+static struct MirrorSlot *changedMirrorSlots;
+static int numChangedMirrorSlots;
+static int changedMirrorSlotsCapacity;
+
+// selected slots that are at most this far apart get drawn in a single range
+static const int mirrorRangeGap = 8;
+
+struct MirrorRange {
+        int first;  // slot
+        int end;
+};
+
+static struct MirrorRange *mirrorRanges;
+static int mirrorRangesCapacity;
+
+/* How the mirror ranges get drawn in one pass of draw_scene() */
+struct MirrorPass {
+        int layer;
+        int features;
+        int blendMode;
+        int depthMode;
+        int isFrontToBack;
+};
+
+/* In a front to back pass, the ranges get split into chunks of at most this
+ * many instances, and the chunks are drawn in reverse order */
+enum {
+        FRONT_TO_BACK_CHUNK_SIZE = 128,
+};
+
+/* The depth buffer has 24 bits. The depths come out of a float computation,
+ * so there should be a few bits to spare, too. With more keys than this,
+ * draw_scene() does without the depth buffer. */
+static const int64_t maxDepthKeys = (int64_t) 1 << 22;
+
+/* See set_depth_range() */
+static int depthFirstObject;
+static int depthNumObjects = 1;
+
+/* While an object is dragged, everything that doesn't move is rendered only
+ * once, into the drag cache. Each dragged shape has its place in the drawing
+ * order (see record_built_instances()), so the dragged shapes split the
+ * static ones into segments, and each segment that isn't empty gets a layer
+ * of its own. The first layer has the background and is opaque, the others
+ * have premultiplied alpha. Each frame of the drag composites the layers
+ * with the dragged shapes in between, which gives the same picture as
+ * drawing everything. If that takes more layers than there are, the drag
+ * goes through the scene layer like any other change. */
+enum {
+        MAX_DRAG_LAYERS = 8,
+};
+
+static GfxTexture dragLayerTexture[MAX_DRAG_LAYERS];
+static GfxFBO dragLayerFBO[MAX_DRAG_LAYERS];
+static int numSizedDragLayers;  // the first ones have the size of the cache
+static int isDragCacheValid;
+static int numDragSegments;  // one more than the number of dragged instances
+static int numDragLayers;  // if it's more than MAX_DRAG_LAYERS, the cache isn't used
+static int *dragLayerOfSegment;  // -1 if the segment is empty
+static int64_t *draggedInstanceKeys;  // that the cache was rendered for
+static int dragSegmentsCapacity;
+static int dragCacheWidth;
+static int dragCacheHeight;
+static float dragCacheZoomFactor;
+static int dragCacheMatcap;
+
+static Object *staticObjects;
+static int staticObjectsCapacity;
+
+/* Draw order. Within a layer, the command list may reorder draws to group
+ * state changes. The scene layer draws the interiors of the shapes first,
+ * opaque and front to back, and the blended edges after that. See
+ * draw_scene(). */
+enum {
+        RENDERLAYER_BACKGROUND,
+        RENDERLAYER_OPAQUE_CIRCLES,
+        RENDERLAYER_OPAQUE_ROUNDRECTS,
+        RENDERLAYER_OPAQUE_ELLIPSES,
+        RENDERLAYER_ELLIPSES,
+        RENDERLAYER_ROUNDRECTS,
+        RENDERLAYER_SPLATS,
+        RENDERLAYER_CIRCLES,
+        RENDERLAYER_LABELS,
+        RENDERLAYER_OVERLAY,
+};
+
+static struct RenderCommandList renderCommandList;
+
+/* The picture is kept in the scene layer between frames, and blitted to the
+ * window. The scene layer is put together from cached tiles, see below. */
+static GfxTexture sceneLayerTexture;
+static GfxFBO sceneLayerFBO;
+static int sceneLayerWidth;
+static int sceneLayerHeight;
+static float sceneLayerZoomFactor;
+static int isSceneLayerValid;
+
+/* Tile (x, y) covers TILE_SIZE x TILE_SIZE scene layer pixels starting at
+ * (x, y) * TILE_SIZE. A tile belongs to a level, which is the zoom factor
+ * and the scene layer size, so going back to a zoom level that is still
+ * cached only needs its tiles composited again. Damage makes the part of
+ * the tiles (of all levels) that it touches dirty, and only that part gets
+ * redrawn when a tile is needed. There is no panning, so the parts of the
+ * border tiles that are outside the scene layer never get shown or drawn.
+ *
+ * The tiles live in the slots of atlas pages, which have a depth buffer for
+ * draw_scene(). Pages get added until the memory budget is reached. After
+ * that, the least recently used tile gets evicted. */
+enum {
+        TILE_SIZE = 256,
+        TILE_PAGE_SIZE = 2048,
+        TILES_PER_PAGE_ROW = TILE_PAGE_SIZE / TILE_SIZE,
+        TILES_PER_PAGE = TILES_PER_PAGE_ROW * TILES_PER_PAGE_ROW,
+};
+
+// 4 bytes of color and 4 bytes of depth per pixel
+static const int64_t tilePageBytes = (int64_t) TILE_PAGE_SIZE * TILE_PAGE_SIZE * 8;
+static const int64_t tileCacheBudgetBytes = (int64_t) 128 << 20;
+
+struct TilePage {
+        GfxTexture gfxTexture;
+        GfxFBO gfxFBO;
+};
+
+struct Tile {
+        int isUsed;
+        float zoomFactor;
+        int levelWidth;
+        int levelHeight;
+        int tileX;
+        int tileY;
+        struct Rect worldRect;
+        int dirtyMinX;  // in pixels of the tile. Clean if dirtyMinX >= dirtyMaxX
+        int dirtyMinY;
+        int dirtyMaxX;
+        int dirtyMaxY;
+        int lastUsedFrame;
+};
+
+static struct TilePage *tilePages;
+static int numTilePages;
+static struct Tile *tiles;  // TILES_PER_PAGE for each page
+static int tileFrame;
+static int *sceneTiles;  // indices of the tiles that make up the scene layer
+static int sceneTilesCapacity;
+static Object *tileObjects;
+static int tileObjectsCapacity;
+
+/* With dynamic resolution, the scene layer is sceneScale times the window
+ * size, and gets upscaled when it is composited. The frames of a drag are
+ * drawn to the scene layer, too. The GPU time of every frame that renders
+ * scene pixels is measured, and divided by the part of the layer that got
+ * rendered, which estimates what a redraw of the whole layer costs. Redraws
+ * of less than minTimedRedrawFraction of the layer are not measured, because
+ * the costs that don't depend on the area make up most of them. If the
+ * estimate goes over budget a few times, the scale goes down a step. If it
+ * stays under half the budget for a while, it goes up a step. The cost is
+ * about proportional to the area, and a step up from the lowest scale costs
+ * (0.6 / 0.5)^2 = 1.44 times as much, so a step up doesn't get us over budget
+ * right away. */
+enum {
+        // more than the GPU timer can have in flight
+        MAX_TIMED_REDRAWS_IN_FLIGHT = 16,
+};
+
+static const double sceneBudgetSeconds = 0.012;
+static const double minTimedRedrawFraction = 0.125;
+static const float minSceneScale = 0.5f;
+static const float sceneScaleStep = 0.1f;
+static const int numSlowRedrawsToScaleDown = 2;
+static const int numFastRedrawsToScaleUp = 20;
+
+static float sceneScale = 1.0f;
+static int numSlowRedraws;
+static int numFastRedraws;
+static int numTimedRedraws;  // started measurements
+static int numCollectedRedraws;  // measurements that came back
+static int firstCurrentScaleRedraw;  // measurements before this are for an older scale
+static double timedRedrawFraction[MAX_TIMED_REDRAWS_IN_FLIGHT];  // of the layer, by measurement
+
+// how far antialiasing and minimum-size splats can reach beyond an object's bounds
+static const float damageMarginPixels = 2.0f;
+
+/* The minimap shows all objects in a corner of the window. It is drawn from
+ * the instance mirror, with a projection that fits the bounds of all
+ * objects. It gets redrawn only when objects were added, moved or restyled,
+ * not for hover highlights, and at most a few times per second. A change
+ * that comes sooner schedules a redraw for when the interval is over. */
+static const float minimapSizeFraction = 0.25f;  // of the smaller window side
+static const int minimapMarginPixels = 8;
+static const double minimapUpdateIntervalSeconds = 1.0 / 6.0;
+
+/* The glyphs of all labels, as instances of the text program. They get laid
+ * out again when the labels or the scene structure change. Otherwise, only
+ * the anchors of the dirty objects get patched, so labels that don't change
+ * cost nothing per frame, and zooming doesn't touch them at all. All labels
+ * are drawn with a single draw. */
+static const float labelFontSize = 0.0175f;  // in world units, about 14 pixels at zoom 1
+static const float labelColor[3] = { 0.95f, 0.95f, 0.95f };
+
+static struct GlyphInstance *labelGlyphs;
+static int numLabelGlyphs;
+static int labelGlyphsCapacity;
+static int *labelFirstGlyph;  // of each object
+static int *labelNumGlyphs;
+static int labelObjectsCapacity;
+static int isLabelBufferValid;
+static int labelStructureVersion;
+static int labelTextVersion;
+static GfxVBO labelVBO;
+
+static GfxTexture minimapTexture;
+static GfxFBO minimapFBO;
+static int minimapSize;
+static int isMinimapValid;
+static int minimapContentVersion;
+static double minimapUpdateTime;
+
+/* For the overdraw heat map, the shapes are counted into a float target
+ * instead of being drawn. The statistics get logged when they change. */
+struct OverdrawStats {
+        double numFragments;
+        float meanPerPixel;
+        float meanPerCoveredPixel;  // over the pixels that got any fragment
+        int maxPerPixel;
+};
+
+static GfxTexture overdrawTexture;
+static GfxFBO overdrawFBO;
+static int overdrawWidth;
+static int overdrawHeight;
+static float *overdrawPixels;
+static struct OverdrawStats loggedOverdrawStats;
+
+static const struct Rect fullClipRect = { -1.0f, -1.0f, 1.0f, 1.0f };
+static const struct Rect fullTexRect = { 0.0f, 0.0f, 1.0f, 1.0f };
 
 static int get_object_state(Object obj)
 {
@@ -275,78 +1069,1524 @@ static int get_object_state(Object obj)
                 return STATE_NORMAL;
 }
 
-void setup_shapesrender(void)
+static void setup_ellipse_vao(GfxVAO vao, GfxVBO instanceVBO)
 {
-        for (int i = 0; i < NUM_SHADER_KINDS; i++)
-                gfxShader[i] = create_GfxShader(shaderInfo[i].shaderType, shaderInfo[i].shaderName);
-        for (int i = 0; i < NUM_PROGRAM_KINDS; i++)
-                gfxProgram[i] = create_GfxProgram("test-program");
-        for (int i = 0; i < LENGTH(linkInfo); i++)
-                add_GfxShader_to_GfxProgram(gfxShader[linkInfo[i].shaderKind], gfxProgram[linkInfo[i].programKind]);
-        for (int i = 0; i < NUM_SHADER_KINDS; i++)
-                set_GfxShader_source(gfxShader[i], shaderInfo[i].shaderSource);
-        for (int i = 0; i < NUM_SHADER_KINDS; i++)
-                compile_GfxShader(gfxShader[i]);
-        for (int i = 0; i < NUM_PROGRAM_KINDS; i++)
-                link_GfxProgram(gfxProgram[i]);
-        for (int i = 0; i < NUM_UNIFORM_KINDS; i++)
-                uniformLocation[i] = get_uniform_location(gfxProgram[uniformInfo[i].programKind], uniformInfo[i].uniformName);
+        set_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ELLIPSE_position], unitQuadVBO, 2, sizeof(struct Vec2), 0);
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ELLIPSE_center], instanceVBO, 2, sizeof(struct EllipseInstance), offsetof(struct EllipseInstance, center));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ELLIPSE_axis], instanceVBO, 2, sizeof(struct EllipseInstance), offsetof(struct EllipseInstance, axis));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ELLIPSE_semiAxes], instanceVBO, 2, sizeof(struct EllipseInstance), offsetof(struct EllipseInstance, semiAxes));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ELLIPSE_color], instanceVBO, 3, sizeof(struct EllipseInstance), offsetof(struct EllipseInstance, color));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ELLIPSE_strokeWidth], instanceVBO, 1, sizeof(struct EllipseInstance), offsetof(struct EllipseInstance, strokeWidth));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ELLIPSE_strokeColor], instanceVBO, 3, sizeof(struct EllipseInstance), offsetof(struct EllipseInstance, strokeColor));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ELLIPSE_order], instanceVBO, 1, sizeof(struct EllipseInstance), offsetof(struct EllipseInstance, order));
+}
+
+static void setup_circle_vao(GfxVAO vao, GfxVBO instanceVBO)
+{
+        set_attribute_pointer(vao, attributeLocation[ATTRIBUTE_CIRCLE_position], unitQuadVBO, 2, sizeof(struct Vec2), 0);
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_CIRCLE_centerPoint], instanceVBO, 2, sizeof(struct CircleInstance), offsetof(struct CircleInstance, centerX));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_CIRCLE_radius], instanceVBO, 1, sizeof(struct CircleInstance), offsetof(struct CircleInstance, radius));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_CIRCLE_color], instanceVBO, 3, sizeof(struct CircleInstance), offsetof(struct CircleInstance, color));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_CIRCLE_strokeWidth], instanceVBO, 1, sizeof(struct CircleInstance), offsetof(struct CircleInstance, strokeWidth));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_CIRCLE_strokeColor], instanceVBO, 3, sizeof(struct CircleInstance), offsetof(struct CircleInstance, strokeColor));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_CIRCLE_order], instanceVBO, 1, sizeof(struct CircleInstance), offsetof(struct CircleInstance, order));
+}
+
+static void setup_roundrect_vao(GfxVAO vao, GfxVBO instanceVBO)
+{
+        set_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ROUNDRECT_position], unitQuadVBO, 2, sizeof(struct Vec2), 0);
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ROUNDRECT_center], instanceVBO, 2, sizeof(struct RoundRectInstance), offsetof(struct RoundRectInstance, center));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ROUNDRECT_halfSize], instanceVBO, 2, sizeof(struct RoundRectInstance), offsetof(struct RoundRectInstance, halfSize));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ROUNDRECT_cornerRadius], instanceVBO, 1, sizeof(struct RoundRectInstance), offsetof(struct RoundRectInstance, cornerRadius));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ROUNDRECT_thickness], instanceVBO, 1, sizeof(struct RoundRectInstance), offsetof(struct RoundRectInstance, thickness));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ROUNDRECT_color], instanceVBO, 3, sizeof(struct RoundRectInstance), offsetof(struct RoundRectInstance, color));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ROUNDRECT_strokeWidth], instanceVBO, 1, sizeof(struct RoundRectInstance), offsetof(struct RoundRectInstance, strokeWidth));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ROUNDRECT_strokeColor], instanceVBO, 3, sizeof(struct RoundRectInstance), offsetof(struct RoundRectInstance, strokeColor));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_ROUNDRECT_order], instanceVBO, 1, sizeof(struct RoundRectInstance), offsetof(struct RoundRectInstance, order));
+}
+
+static void setup_splat_vao(GfxVAO vao, GfxVBO instanceVBO)
+{
+        set_attribute_pointer(vao, attributeLocation[ATTRIBUTE_SPLAT_position], unitQuadVBO, 2, sizeof(struct Vec2), 0);
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_SPLAT_centerPoint], instanceVBO, 2, sizeof(struct SplatInstance), offsetof(struct SplatInstance, centerX));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_SPLAT_halfSize], instanceVBO, 1, sizeof(struct SplatInstance), offsetof(struct SplatInstance, halfSize));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_SPLAT_area], instanceVBO, 1, sizeof(struct SplatInstance), offsetof(struct SplatInstance, area));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_SPLAT_color], instanceVBO, 3, sizeof(struct SplatInstance), offsetof(struct SplatInstance, color));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_SPLAT_order], instanceVBO, 1, sizeof(struct SplatInstance), offsetof(struct SplatInstance, order));
+}
+
+static void setup_text_vao(GfxVAO vao, GfxVBO instanceVBO)
+{
+        set_attribute_pointer(vao, attributeLocation[ATTRIBUTE_TEXT_position], unitQuadVBO, 2, sizeof(struct Vec2), 0);
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_TEXT_anchor], instanceVBO, 2, sizeof(struct GlyphInstance), offsetof(struct GlyphInstance, anchor));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_TEXT_offset], instanceVBO, 2, sizeof(struct GlyphInstance), offsetof(struct GlyphInstance, offset));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_TEXT_size], instanceVBO, 2, sizeof(struct GlyphInstance), offsetof(struct GlyphInstance, size));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_TEXT_texRect], instanceVBO, 4, sizeof(struct GlyphInstance), offsetof(struct GlyphInstance, texRect));
+        set_instanced_attribute_pointer(vao, attributeLocation[ATTRIBUTE_TEXT_color], instanceVBO, 3, sizeof(struct GlyphInstance), offsetof(struct GlyphInstance, color));
+}
+
+static float dot3(const float *a, const float *b)
+{
+        return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void normalize3(float *v)
+{
+        float len = sqrtf(dot3(v, v));
+        v[0] /= len;
+        v[1] /= len;
+        v[2] /= len;
+}
+
+/* Same as compute_specular_strength() in the circle shader */
+static float compute_specular_strength(const float *lightPos, const float *surfacePoint, const float *normal, const float *spectatorPosition)
+{
+        float lightToSurface[3];
+        float reflectVector[3];
+        float spectateDirection[3];
+        for (int k = 0; k < 3; k++)
+                lightToSurface[k] = surfacePoint[k] - lightPos[k];
+        float proj = dot3(lightToSurface, normal);
+        for (int k = 0; k < 3; k++) {
+                reflectVector[k] = lightToSurface[k] - 2.0f * proj * normal[k];
+                spectateDirection[k] = spectatorPosition[k] - surfacePoint[k];
+        }
+        normalize3(reflectVector);
+        normalize3(spectateDirection);
+        float x = dot3(reflectVector, spectateDirection);
+        x = x < 0.0f ? 0.0f : x > 1.0f ? 1.0f : x;
+        return x * x * x * x;
+}
+
+/* Evaluates the lighting of the circle shader once for each texel of a unit
+ * disc, for the reference circle. Texels outside the disc get the lighting
+ * of the nearest point of the rim, so that filtering at the edge works. */
+static void make_matcap(void)
+{
+        static unsigned char texels[MATCAP_SIZE][MATCAP_SIZE][4];
+        const float r = matcapReferenceRadius;
+        const float lightPos[3] = { 0.2f, 0.5f, 5.0f * r };
+        const float lightPos2[3] = { 1.0f, 1.0f, 1.0f };
+        const float spectatorPosition[3] = { 0.5f, 0.5f, 6.0f };
+        for (int j = 0; j < MATCAP_SIZE; j++) {
+                for (int i = 0; i < MATCAP_SIZE; i++) {
+                        float qx = 2.0f * (i + 0.5f) / MATCAP_SIZE - 1.0f;
+                        float qy = 2.0f * (j + 0.5f) / MATCAP_SIZE - 1.0f;
+                        float q = sqrtf(qx * qx + qy * qy);
+                        if (q > 0.999f) {
+                                qx *= 0.999f / q;
+                                qy *= 0.999f / q;
+                        }
+                        float surfacePoint[3];
+                        surfacePoint[0] = matcapReferenceX + r * qx;
+                        surfacePoint[1] = matcapReferenceY + r * qy;
+                        surfacePoint[2] = r * sqrtf(1.0f - qx * qx - qy * qy);
+                        float normal[3] = { qx, qy, surfacePoint[2] / r };
+                        normalize3(normal);
+                        float surfaceToLight[3];
+                        for (int k = 0; k < 3; k++)
+                                surfaceToLight[k] = lightPos[k] - surfacePoint[k];
+                        normalize3(surfaceToLight);
+                        float diffuseStrength = dot3(surfaceToLight, normal);
+                        diffuseStrength = (diffuseStrength < 0.0f ? 0.0f : diffuseStrength > 1.0f ? 1.0f : diffuseStrength) + 0.2f;
+                        float s1 = compute_specular_strength(lightPos, surfacePoint, normal, spectatorPosition);
+                        float s2 = compute_specular_strength(lightPos2, surfacePoint, normal, spectatorPosition);
+                        float texel[4];
+                        texel[0] = 0.5f * s2 * 0.3f;
+                        texel[1] = 0.5f * s1;
+                        texel[2] = 0.5f * s1 + 0.5f * s2 * 0.6f;
+                        texel[3] = 0.1f + 0.3f * diffuseStrength;
+                        for (int k = 0; k < 4; k++)
+                                texels[j][i][k] = (unsigned char) (texel[k] * 255.0f + 0.5f);
+                }
+        }
+        set_GfxTexture_data(matcapTexture, TEXTUREFORMAT_RGBA8, MATCAP_SIZE, MATCAP_SIZE, texels);
+}
+
+static void compile_program_variant(struct ProgramVariant *variant)
+{
+        const char *sources[2 + NUM_SHADERFEATURE_KINDS];
+        int numSources = 0;
+        sources[numSources++] = shaderPrologue;
+        for (int i = 0; i < NUM_SHADERFEATURE_KINDS; i++)
+                if (variant->features & (1 << i))
+                        sources[numSources++] = shaderFeatureDefine[i];
+        numSources++;  // the shader source goes last
+
+        variant->gfxProgram = create_GfxProgram(programName[variant->programKind]);
+        for (int i = 0; i < LENGTH(linkInfo); i++) {
+                if (linkInfo[i].programKind != variant->programKind)
+                        continue;
+                const struct ShaderInfo *info = &shaderInfo[linkInfo[i].shaderKind];
+                GfxShader gfxShader = create_GfxShader(info->shaderType, info->shaderName);
+                sources[numSources - 1] = info->shaderSource;
+                set_GfxShader_sources(gfxShader, numSources, sources);
+                compile_GfxShader(gfxShader);
+                add_GfxShader_to_GfxProgram(gfxShader, variant->gfxProgram);
+        }
         for (int i = 0; i < NUM_ATTRIBUTE_KINDS; i++)
-                attributeLocation[i] = get_attribute_location(gfxProgram[attributeInfo[i].programKind], attributeInfo[i].attributeName);
+                if (attributeInfo[i].programKind == variant->programKind)
+                        bind_attribute_location(variant->gfxProgram, attributeLocation[i], attributeInfo[i].attributeName);
+        link_GfxProgram(variant->gfxProgram);
+        // Samplers are not set here. They all use texture unit 0, which is
+        // the default.
+        for (int i = 0; i < NUM_UNIFORM_KINDS; i++)
+                if (uniformInfo[i].programKind == variant->programKind)
+                        variant->uniformLocation[i] = get_uniform_location(variant->gfxProgram, uniformInfo[i].uniformName);
+}
+
+/* Compiles the variant the first time it is asked for */
+static const struct ProgramVariant *get_program_variant(int programKey)
+{
+        if (variantOfProgramKey[programKey] != 0)
+                return &programVariants[variantOfProgramKey[programKey] - 1];
+        if (numProgramVariants == MAX_PROGRAM_VARIANTS)
+                fatalf("Too many program variants\n");
+        struct ProgramVariant *variant = &programVariants[numProgramVariants++];
+        variant->programKind = programKey & ((1 << PROGRAM_KEY_FEATURES_SHIFT) - 1);
+        variant->features = programKey >> PROGRAM_KEY_FEATURES_SHIFT;
+        compile_program_variant(variant);
+        variantOfProgramKey[programKey] = (unsigned char) numProgramVariants;
+        return variant;
+}
+
+static int make_program_key(int programKind, int features)
+{
+        return programKind | features << PROGRAM_KEY_FEATURES_SHIFT;
+}
+
+/* The program key of the variant that the current settings call for, plus
+ * the given features */
+static int get_current_program_key(int programKind, int features)
+{
+        if (programKind == PROGRAM_CIRCLE && isMatcapEnabled && !(features & (1 << SHADERFEATURE_FLAT)))
+                features |= 1 << SHADERFEATURE_MATCAP;
+        return make_program_key(programKind, features);
+}
+
+/* Called when the render command list gets submitted, on the GL thread */
+static GfxProgram resolve_program_key(int programKey, const UniformLocation **outUniformLocations)
+{
+        const struct ProgramVariant *variant = get_program_variant(programKey);
+        *outUniformLocations = variant->uniformLocation;
+        return variant->gfxProgram;
+}
+
+void setup_shapesrender(void)
+{
+        ENSURE(NUM_PROGRAM_KINDS <= 1 << PROGRAM_KEY_FEATURES_SHIFT);
+        renderCommandList.resolveProgram = resolve_program_key;
+        // the attributes of each program kind are bound to locations 0, 1, ...
+        for (int i = 0; i < NUM_ATTRIBUTE_KINDS; i++) {
+                attributeLocation[i] = 0;
+                for (int j = 0; j < i; j++)
+                        if (attributeInfo[j].programKind == attributeInfo[i].programKind)
+                                attributeLocation[i]++;
+        }
         for (int i = 0; i < NUM_PROGRAM_KINDS; i++)
                 gfxVaoOfProgram[i] = create_GfxVAO();
-        gfxVBO = create_GfxVBO();
-        set_attribute_pointer(gfxVaoOfProgram[PROGRAM_ELLIPSE], attributeLocation[ATTRIBUTE_ELLIPSE_position], gfxVBO, 2, sizeof(struct Vec2), 0);
-        set_attribute_pointer(gfxVaoOfProgram[PROGRAM_CIRCLE], attributeLocation[ATTRIBUTE_CIRCLE_position], gfxVBO, 2, sizeof(struct Vec2), 0);
-        set_attribute_pointer(gfxVaoOfProgram[PROGRAM_TEST], attributeLocation[ATTRIBUTE_TEST_position], gfxVBO, 2, sizeof(struct Vec2), 0);
+        unitQuadVBO = create_GfxVBO();
+        set_GfxVBO_data(unitQuadVBO, &unitQuadVerts, sizeof unitQuadVerts);
+        // the streaming path writes the instances to the stream buffer each frame
+        setup_ellipse_vao(gfxVaoOfProgram[PROGRAM_ELLIPSE], get_stream_GfxVBO());
+        setup_circle_vao(gfxVaoOfProgram[PROGRAM_CIRCLE], get_stream_GfxVBO());
+        setup_roundrect_vao(gfxVaoOfProgram[PROGRAM_ROUNDRECT], get_stream_GfxVBO());
+        setup_splat_vao(gfxVaoOfProgram[PROGRAM_SPLAT], get_stream_GfxVBO());
+        for (int i = INSTANCE_NONE + 1; i < NUM_INSTANCE_KINDS; i++) {
+                instanceMirrors[i].gfxVBO = create_GfxVBO();
+                instanceMirrors[i].gfxVAO = create_GfxVAO();
+        }
+        setup_ellipse_vao(instanceMirrors[INSTANCE_ELLIPSE].gfxVAO, instanceMirrors[INSTANCE_ELLIPSE].gfxVBO);
+        setup_circle_vao(instanceMirrors[INSTANCE_CIRCLE].gfxVAO, instanceMirrors[INSTANCE_CIRCLE].gfxVBO);
+        setup_roundrect_vao(instanceMirrors[INSTANCE_ROUNDRECT].gfxVAO, instanceMirrors[INSTANCE_ROUNDRECT].gfxVBO);
+        setup_splat_vao(instanceMirrors[INSTANCE_SPLAT].gfxVAO, instanceMirrors[INSTANCE_SPLAT].gfxVBO);
+        set_attribute_pointer(gfxVaoOfProgram[PROGRAM_COMPOSITE], attributeLocation[ATTRIBUTE_COMPOSITE_position], unitQuadVBO, 2, sizeof(struct Vec2), 0);
+        set_attribute_pointer(gfxVaoOfProgram[PROGRAM_HEATMAP], attributeLocation[ATTRIBUTE_HEATMAP_position], unitQuadVBO, 2, sizeof(struct Vec2), 0);
+        labelVBO = create_GfxVBO();
+        setup_text_vao(gfxVaoOfProgram[PROGRAM_TEXT], labelVBO);
+        for (int i = 0; i < MAX_DRAG_LAYERS; i++) {
+                dragLayerTexture[i] = create_GfxTexture();
+                dragLayerFBO[i] = create_GfxFBO();
+        }
+        sceneLayerTexture = create_GfxTexture();
+        sceneLayerFBO = create_GfxFBO();
+        minimapTexture = create_GfxTexture();
+        minimapFBO = create_GfxFBO();
+        overdrawTexture = create_GfxTexture();
+        overdrawFBO = create_GfxFBO();
+        matcapTexture = create_GfxTexture();
+        make_matcap();
+}
+
+/* Pick the depths for drawing the given objects (in increasing order), or
+ * all objects if objectList is NULL. The depth of an instance is
+ * depthBias + depthScale * (order - firstOrder), where order is the Object.
+ * The uniforms for each rank are set such that all keys
+ * (rank * depthNumObjects + object - depthFirstObject) get distinct depths
+ * between -1 and 1, and higher keys are nearer. Only the span of the drawn
+ * objects counts, so a tile needs fewer keys than the whole scene. Returns
+ * whether the keys fit into the precision of the depth buffer. Draws that
+ * don't use the depth buffer get depths, too, so that their instances stay
+ * inside the clip volume. */
+static int set_depth_range(const Object *objectList, int numObjectsInList)
+{
+        if (objectList == NULL || numObjectsInList == 0) {
+                depthFirstObject = 0;
+                depthNumObjects = numObjects > 0 ? numObjects : 1;
+        }
+        else {
+                depthFirstObject = objectList[0];
+                depthNumObjects = objectList[numObjectsInList - 1] + 1 - depthFirstObject;
+        }
+        return (int64_t) NUM_DEPTHRANKS * depthNumObjects <= maxDepthKeys;
+}
+
+static void record_depth_uniforms(int instanceKind)
+{
+        const struct InstanceKindInfo *info = &instanceKindInfo[instanceKind];
+        float numKeys = (float) NUM_DEPTHRANKS * depthNumObjects + 1.0f;
+        float firstKey = (float) info->depthRank * depthNumObjects + 1.0f;
+        record_uniform_1f(&renderCommandList, info->depthBiasUniform, 1.0f - 2.0f * firstKey / numKeys);
+        record_uniform_1f(&renderCommandList, info->depthScaleUniform, -2.0f / numKeys);
+        record_uniform_1f(&renderCommandList, info->firstOrderUniform, (float) depthFirstObject);
+}
+
+/* The splat is the bounding square of the shape */
+static void make_splat_instance(struct SplatInstance *instance, Object obj, float x, float y, float halfSize, float area, const float *color, float brightness)
+{
+        instance->centerX = x;
+        instance->centerY = y;
+        instance->halfSize = halfSize;
+        instance->area = area;
+        instance->color[0] = brightness * color[0];
+        instance->color[1] = brightness * color[1];
+        instance->color[2] = brightness * color[2];
+        instance->order = (float) obj;
 }
 
-static void draw_ellipse(Object ellipse)
+/* Each of the make_*_instance() functions fills in both the full instance and
+ * the splat instance of an object, and returns the projected size that
+ * decides between the two (see pick_lod()) */
+static float make_ellipse_instance(Object obj, struct EllipseInstance *instance, struct SplatInstance *splatInstance)
 {
-        const struct Ellipse *e = &objects[ellipse].data.tEllipse;
+        const struct Ellipse *e = &objects[obj].data.tEllipse;
         const struct Circle *c0 = &objects[e->centerCircle0].data.tCircle;
         const struct Circle *c1 = &objects[e->centerCircle1].data.tCircle;
-        const struct Vec2 ellipseControlPoints[2] = {
-                { c0->centerX, c0->centerY },
-                { c1->centerX, c1->centerY },
+        const float *color = ellipseColors[get_object_state(obj)];
+        float dx = c1->centerX - c0->centerX;
+        float dy = c1->centerY - c0->centerY;
+        float a = 0.5f * e->radius;
+        float c = 0.5f * sqrtf(dx * dx + dy * dy);
+        if (a <= c) {
+                // empty
+                memset(instance, 0, sizeof *instance);
+                memset(splatInstance, 0, sizeof *splatInstance);
+                return -1.0f;
+        }
+        float b = sqrtf(a * a - c * c);
+        float x = 0.5f * (c0->centerX + c1->centerX);
+        float y = 0.5f * (c0->centerY + c1->centerY);
+        make_splat_instance(splatInstance, obj, x, y, a, 3.14159265f * a * b, color, 1.0f);
+        instance->center[0] = x;
+        instance->center[1] = y;
+        instance->axis[0] = c > 0.0f ? dx / (2.0f * c) : 1.0f;
+        instance->axis[1] = c > 0.0f ? dy / (2.0f * c) : 0.0f;
+        instance->semiAxes[0] = a;
+        instance->semiAxes[1] = b;
+        instance->color[0] = color[0];
+        instance->color[1] = color[1];
+        instance->color[2] = color[2];
+        instance->strokeWidth = objects[obj].strokeWidth;
+        instance->strokeColor[0] = objects[obj].strokeColor[0];
+        instance->strokeColor[1] = objects[obj].strokeColor[1];
+        instance->strokeColor[2] = objects[obj].strokeColor[2];
+        instance->order = (float) obj;
+        return e->radius;
+}
+
+static float make_circle_instance(Object obj, struct CircleInstance *instance, struct SplatInstance *splatInstance)
+{
+        const struct Circle *circle = &objects[obj].data.tCircle;
+        const float *color = circleColors[get_object_state(obj)];
+        float area = 3.14159265f * circle->radius * circle->radius;
+        make_splat_instance(splatInstance, obj, circle->centerX, circle->centerY, circle->radius, area, color, circleSplatBrightness);
+        instance->centerX = circle->centerX;
+        instance->centerY = circle->centerY;
+        instance->radius = circle->radius;
+        instance->color[0] = color[0];
+        instance->color[1] = color[1];
+        instance->color[2] = color[2];
+        instance->strokeWidth = objects[obj].strokeWidth;
+        instance->strokeColor[0] = objects[obj].strokeColor[0];
+        instance->strokeColor[1] = objects[obj].strokeColor[1];
+        instance->strokeColor[2] = objects[obj].strokeColor[2];
+        instance->order = (float) obj;
+        return 2.0f * circle->radius;
+}
+
+/* area of a rounded rectangle with the given half size and corner radius */
+static float get_roundrect_area(float halfWidth, float halfHeight, float cornerRadius)
+{
+        return 4.0f * halfWidth * halfHeight - (4.0f - 3.14159265f) * cornerRadius * cornerRadius;
+}
+
+static float make_roundrect_instance(Object obj, struct RoundRectInstance *instance, struct SplatInstance *splatInstance)
+{
+        const struct RoundRect *rect = &objects[obj].data.tRoundRect;
+        const float *color = roundRectColors[get_object_state(obj)];
+        float minHalfSize = fminf(rect->halfWidth, rect->halfHeight);
+        // If the outline is at least as thick as the smaller half size, the
+        // rectangle is filled. It must not get an inner edge in the middle.
+        int isFilled = rect->thickness >= minHalfSize;
+        float area = get_roundrect_area(rect->halfWidth, rect->halfHeight, rect->cornerRadius);
+        if (!isFilled)
+                area -= get_roundrect_area(rect->halfWidth - rect->thickness, rect->halfHeight - rect->thickness,
+                        fmaxf(rect->cornerRadius - rect->thickness, 0.0f));
+        make_splat_instance(splatInstance, obj, rect->centerX, rect->centerY, fmaxf(rect->halfWidth, rect->halfHeight), area, color, 1.0f);
+        instance->center[0] = rect->centerX;
+        instance->center[1] = rect->centerY;
+        instance->halfSize[0] = rect->halfWidth;
+        instance->halfSize[1] = rect->halfHeight;
+        instance->cornerRadius = rect->cornerRadius;
+        instance->thickness = isFilled ? 2.0f * minHalfSize : rect->thickness;
+        instance->color[0] = color[0];
+        instance->color[1] = color[1];
+        instance->color[2] = color[2];
+        instance->strokeWidth = objects[obj].strokeWidth;
+        instance->strokeColor[0] = objects[obj].strokeColor[0];
+        instance->strokeColor[1] = objects[obj].strokeColor[1];
+        instance->strokeColor[2] = objects[obj].strokeColor[2];
+        instance->order = (float) obj;
+        return 2.0f * fmaxf(rect->halfWidth, rect->halfHeight);
+}
+
+static int get_instance_kind(Object obj)
+{
+        if (objects[obj].objectKind == OBJECT_ELLIPSE)
+                return INSTANCE_ELLIPSE;
+        else if (objects[obj].objectKind == OBJECT_CIRCLE)
+                return INSTANCE_CIRCLE;
+        else if (objects[obj].objectKind == OBJECT_ROUNDRECT)
+                return INSTANCE_ROUNDRECT;
+        else
+                UNREACHABLE();
+}
+
+/* Shapes that are too small at the current pixelsPerWorldUnit are drawn as
+ * splats, and empty ones not at all */
+static int pick_lod(int instanceKind, float size)
+{
+        if (size < 0.0f)
+                return INSTANCE_NONE;
+        if (size * pixelsPerWorldUnit < lodSplatThresholdPixels)
+                return INSTANCE_SPLAT;
+        return instanceKind;
+}
+
+/* Which buffer of the instance mirror the object gets drawn from */
+static int get_object_lod(Object obj)
+{
+        return pick_lod(mirrorKindOfObject[obj], mirrorSizeOfObject[obj]);
+}
+
+/* Sort the objects into the instance buffers, depending on their kind and
+ * their size on the screen */
+static void build_instances(const Object *objectList, int numObjectsInList)
+{
+        if (instancesCapacity < numObjectsInList) {
+                instancesCapacity = numObjectsInList;
+                REALLOC_MEMORY(&ellipseInstances, instancesCapacity);
+                REALLOC_MEMORY(&circleInstances, instancesCapacity);
+                REALLOC_MEMORY(&roundRectInstances, instancesCapacity);
+                REALLOC_MEMORY(&splatInstances, instancesCapacity);
+        }
+        numEllipseInstances = 0;
+        numCircleInstances = 0;
+        numRoundRectInstances = 0;
+        numSplatInstances = 0;
+        for (int i = 0; i < numObjectsInList; i++) {
+                Object obj = objectList[i];
+                int instanceKind = get_instance_kind(obj);
+                float size = 0.0f;
+                if (instanceKind == INSTANCE_ELLIPSE)
+                        size = make_ellipse_instance(obj, &ellipseInstances[numEllipseInstances], &splatInstances[numSplatInstances]);
+                else if (instanceKind == INSTANCE_CIRCLE)
+                        size = make_circle_instance(obj, &circleInstances[numCircleInstances], &splatInstances[numSplatInstances]);
+                else if (instanceKind == INSTANCE_ROUNDRECT)
+                        size = make_roundrect_instance(obj, &roundRectInstances[numRoundRectInstances], &splatInstances[numSplatInstances]);
+                int lod = pick_lod(instanceKind, size);
+                if (lod == INSTANCE_ELLIPSE)
+                        numEllipseInstances++;
+                else if (lod == INSTANCE_CIRCLE)
+                        numCircleInstances++;
+                else if (lod == INSTANCE_ROUNDRECT)
+                        numRoundRectInstances++;
+                else if (lod == INSTANCE_SPLAT)
+                        numSplatInstances++;
+        }
+}
+
+static void *get_mirror_slot(int instanceKind, int slot)
+{
+        return (char *) instanceMirrors[instanceKind].data + (size_t) slot * instanceKindInfo[instanceKind].instanceSize;
+}
+
+static void note_changed_mirror_slot(int instanceKind, int slot)
+{
+        if (changedMirrorSlotsCapacity == numChangedMirrorSlots) {
+                changedMirrorSlotsCapacity = 2 * changedMirrorSlotsCapacity + 16;
+                REALLOC_MEMORY(&changedMirrorSlots, changedMirrorSlotsCapacity);
+        }
+        changedMirrorSlots[numChangedMirrorSlots].instanceKind = instanceKind;
+        changedMirrorSlots[numChangedMirrorSlots].slot = slot;
+        numChangedMirrorSlots++;
+}
+
+static int append_mirror_slot(int instanceKind)
+{
+        struct InstanceMirror *mirror = &instanceMirrors[instanceKind];
+        if (mirror->capacity == mirror->numSlots) {
+                mirror->capacity = 2 * mirror->capacity + 64;
+                realloc_memory(&mirror->data, mirror->capacity, instanceKindInfo[instanceKind].instanceSize);
+                mirror->isFullUploadNeeded = 1;
+        }
+        return mirror->numSlots++;
+}
+
+static void write_mirror_slots(Object obj)
+{
+        int instanceKind = mirrorKindOfObject[obj];
+        int slot = mirrorSlotOfObject[obj];
+        void *instance = get_mirror_slot(instanceKind, slot);
+        struct SplatInstance *splatInstance = get_mirror_slot(INSTANCE_SPLAT, obj);
+        if (instanceKind == INSTANCE_ELLIPSE)
+                mirrorSizeOfObject[obj] = make_ellipse_instance(obj, instance, splatInstance);
+        else if (instanceKind == INSTANCE_CIRCLE)
+                mirrorSizeOfObject[obj] = make_circle_instance(obj, instance, splatInstance);
+        else if (instanceKind == INSTANCE_ROUNDRECT)
+                mirrorSizeOfObject[obj] = make_roundrect_instance(obj, instance, splatInstance);
+        note_changed_mirror_slot(instanceKind, slot);
+        note_changed_mirror_slot(INSTANCE_SPLAT, obj);
+}
+
+static int compare_MirrorSlot(const void *a, const void *b)
+{
+        const struct MirrorSlot *x = a;
+        const struct MirrorSlot *y = b;
+        if (x->instanceKind != y->instanceKind)
+                return x->instanceKind - y->instanceKind;
+        return (x->slot > y->slot) - (x->slot < y->slot);
+}
+
+/* One upload per run of adjacent changed slots. A buffer that had to grow
+ * gets uploaded as a whole instead. */
+static void upload_changed_mirror_slots(void)
+{
+        qsort(changedMirrorSlots, numChangedMirrorSlots, sizeof *changedMirrorSlots, &compare_MirrorSlot);
+        int runStart = 0;
+        for (int i = 0; i < numChangedMirrorSlots; i++) {
+                const struct MirrorSlot *s = &changedMirrorSlots[i];
+                if (i + 1 < numChangedMirrorSlots
+                    && changedMirrorSlots[i + 1].instanceKind == s->instanceKind
+                    && changedMirrorSlots[i + 1].slot <= s->slot + 1)
+                        continue;
+                const struct MirrorSlot *first = &changedMirrorSlots[runStart];
+                runStart = i + 1;
+                const struct InstanceMirror *mirror = &instanceMirrors[s->instanceKind];
+                if (mirror->isFullUploadNeeded)
+                        continue;
+                int instanceSize = instanceKindInfo[s->instanceKind].instanceSize;
+                set_GfxVBO_subdata(mirror->gfxVBO, (uint64_t) first->slot * instanceSize,
+                        get_mirror_slot(s->instanceKind, first->slot), (uint64_t) (s->slot + 1 - first->slot) * instanceSize);
+        }
+        numChangedMirrorSlots = 0;
+        for (int i = INSTANCE_NONE + 1; i < NUM_INSTANCE_KINDS; i++) {
+                struct InstanceMirror *mirror = &instanceMirrors[i];
+                if (!mirror->isFullUploadNeeded)
+                        continue;
+                int instanceSize = instanceKindInfo[i].instanceSize;
+                set_GfxVBO_data(mirror->gfxVBO, NULL, (uint64_t) mirror->capacity * instanceSize);
+                set_GfxVBO_subdata(mirror->gfxVBO, 0, mirror->data, (uint64_t) mirror->numSlots * instanceSize);
+                mirror->isFullUploadNeeded = 0;
+        }
+}
+
+/* Bring the instance mirror up to date and consume the dirty objects. New
+ * objects (which are dirty, too) get slots at the end of their buffers. */
+static void update_instance_mirror(void)
+{
+        if (mirrorObjectsCapacity < numObjects) {
+                mirrorObjectsCapacity = numObjects;
+                REALLOC_MEMORY(&mirrorKindOfObject, mirrorObjectsCapacity);
+                REALLOC_MEMORY(&mirrorSlotOfObject, mirrorObjectsCapacity);
+                REALLOC_MEMORY(&mirrorSizeOfObject, mirrorObjectsCapacity);
+        }
+        int numOldObjects = numMirroredObjects;
+        for (Object obj = numMirroredObjects; obj < numObjects; obj++) {
+                mirrorKindOfObject[obj] = get_instance_kind(obj);
+                mirrorSlotOfObject[obj] = append_mirror_slot(mirrorKindOfObject[obj]);
+                append_mirror_slot(INSTANCE_SPLAT);  // at obj
+                write_mirror_slots(obj);
+        }
+        numMirroredObjects = numObjects;
+        for (int i = 0; i < numDirtyObjects; i++)
+                if (dirtyObjects[i] < numOldObjects)
+                        write_mirror_slots(dirtyObjects[i]);
+        reset_dirty_objects();
+        upload_changed_mirror_slots();
+}
+
+/* Find the runs of slots in the buffer of the given kind to draw for the
+ * selected objects (in increasing order, or all objects if objectList is
+ * NULL) that are drawn from that buffer at the current level of detail. Runs
+ * with small gaps are merged into one. The extra slots in the gaps belong to
+ * objects that were not selected, so they don't touch the area that is being
+ * drawn. But a selected object that is drawn from another buffer ends the
+ * run, since its slot in this buffer holds an instance, too. */
+static int collect_mirror_ranges(const Object *objectList, int numObjectsInList, int instanceKind)
+{
+        int numRanges = 0;
+        int isRangeOpen = 0;
+        for (int i = 0; i < numObjectsInList; i++) {
+                Object obj = objectList ? objectList[i] : i;
+                int slot;
+                if (instanceKind == INSTANCE_SPLAT)
+                        slot = obj;
+                else if (mirrorKindOfObject[obj] == instanceKind)
+                        slot = mirrorSlotOfObject[obj];
+                else
+                        continue;
+                if (get_object_lod(obj) != instanceKind) {
+                        isRangeOpen = 0;
+                        continue;
+                }
+                if (isRangeOpen && slot - mirrorRanges[numRanges - 1].end <= mirrorRangeGap) {
+                        mirrorRanges[numRanges - 1].end = slot + 1;
+                        continue;
+                }
+                if (mirrorRangesCapacity == numRanges) {
+                        mirrorRangesCapacity = 2 * mirrorRangesCapacity + 16;
+                        REALLOC_MEMORY(&mirrorRanges, mirrorRangesCapacity);
+                }
+                mirrorRanges[numRanges].first = slot;
+                mirrorRanges[numRanges].end = slot + 1;
+                numRanges++;
+                isRangeOpen = 1;
+        }
+        return numRanges;
+}
+
+/* The uniforms and textures that the instanced programs need */
+static void record_instance_uniforms(int instanceKind)
+{
+        const struct InstanceKindInfo *info = &instanceKindInfo[instanceKind];
+        record_uniform_mat3f(&renderCommandList, info->projMatUniform, &projMat[0][0]);
+        record_depth_uniforms(instanceKind);
+        if (info->pixelsPerWorldUnitUniform != -1)
+                record_uniform_1f(&renderCommandList, info->pixelsPerWorldUnitUniform, pixelsPerWorldUnit);
+        if (info->programKind == PROGRAM_CIRCLE)
+                record_texture(&renderCommandList, matcapTexture);
+}
+
+static void record_mirror_draw(int programKey, int instanceKind, const struct MirrorPass *pass, int first, int end)
+{
+        record_draw(&renderCommandList, pass->layer, programKey, instanceMirrors[instanceKind].gfxVAO, pass->blendMode, 0, LENGTH(unitQuadVerts), end - first);
+        record_base_instance(&renderCommandList, first);
+        record_depth_mode(&renderCommandList, pass->depthMode);
+        record_instance_uniforms(instanceKind);
+}
+
+/* Record draws for the collected mirror ranges. A front to back pass draws
+ * the instances roughly in reverse: the ranges go in reverse, and each range
+ * is split into chunks that go in reverse, too. So the shapes on top tend to
+ * be drawn first and hide the ones below from the fragment shader. Only the
+ * order within a chunk stays back to front. */
+static void record_mirror_ranges(int numRanges, int instanceKind, const struct MirrorPass *pass)
+{
+        if (numRanges == 0)
+                return;
+        int programKey = get_current_program_key(instanceKindInfo[instanceKind].programKind, pass->features);
+        for (int j = 0; j < numRanges; j++) {
+                if (!pass->isFrontToBack) {
+                        record_mirror_draw(programKey, instanceKind, pass, mirrorRanges[j].first, mirrorRanges[j].end);
+                        continue;
+                }
+                const struct MirrorRange *range = &mirrorRanges[numRanges - 1 - j];
+                for (int end = range->end; end > range->first; end -= FRONT_TO_BACK_CHUNK_SIZE) {
+                        int first = end - FRONT_TO_BACK_CHUNK_SIZE > range->first ? end - FRONT_TO_BACK_CHUNK_SIZE : range->first;
+                        record_mirror_draw(programKey, instanceKind, pass, first, end);
+                }
+        }
+}
+
+/* Draw instances from the stream buffer */
+static void record_instances(int instanceKind, int layer, int blendMode, const void *instances, int numInstances)
+{
+        if (numInstances == 0)
+                return;
+        const struct InstanceKindInfo *info = &instanceKindInfo[instanceKind];
+        record_draw(&renderCommandList, layer, get_current_program_key(info->programKind, 0), gfxVaoOfProgram[info->programKind], blendMode, 0, LENGTH(unitQuadVerts), numInstances);
+        record_upload(&renderCommandList, instances, numInstances * info->instanceSize, info->instanceSize);
+        record_instance_uniforms(instanceKind);
+}
+
+/* The instances that build_instances() made are drawn kind after kind, in
+ * this order, and the instances of a kind in the order of the objects. That
+ * is the same order as in draw_scene(). */
+static const struct {
+        int instanceKind;
+        int layer;
+} builtInstanceDrawingOrder[] = {
+        { INSTANCE_ELLIPSE, RENDERLAYER_ELLIPSES },
+        { INSTANCE_ROUNDRECT, RENDERLAYER_ROUNDRECTS },
+        { INSTANCE_SPLAT, RENDERLAYER_SPLATS },
+        { INSTANCE_CIRCLE, RENDERLAYER_CIRCLES },
+};
+
+static const void *get_built_instances(int instanceKind, int *outNumInstances)
+{
+        if (instanceKind == INSTANCE_ELLIPSE) {
+                *outNumInstances = numEllipseInstances;
+                return ellipseInstances;
+        }
+        else if (instanceKind == INSTANCE_CIRCLE) {
+                *outNumInstances = numCircleInstances;
+                return circleInstances;
+        }
+        else if (instanceKind == INSTANCE_ROUNDRECT) {
+                *outNumInstances = numRoundRectInstances;
+                return roundRectInstances;
+        }
+        else if (instanceKind == INSTANCE_SPLAT) {
+                *outNumInstances = numSplatInstances;
+                return splatInstances;
+        }
+        else
+                UNREACHABLE();
+}
+
+static int get_num_built_instances(void)
+{
+        return numEllipseInstances + numRoundRectInstances + numSplatInstances + numCircleInstances;
+}
+
+/* Increases along the drawing order of the built instances */
+static int64_t get_built_instance_key(int position)
+{
+        for (int i = 0; i < LENGTH(builtInstanceDrawingOrder); i++) {
+                int instanceKind = builtInstanceDrawingOrder[i].instanceKind;
+                int numInstances;
+                get_built_instances(instanceKind, &numInstances);
+                if (position >= numInstances) {
+                        position -= numInstances;
+                        continue;
+                }
+                float order;
+                if (instanceKind == INSTANCE_ELLIPSE)
+                        order = ellipseInstances[position].order;
+                else if (instanceKind == INSTANCE_CIRCLE)
+                        order = circleInstances[position].order;
+                else if (instanceKind == INSTANCE_ROUNDRECT)
+                        order = roundRectInstances[position].order;
+                else
+                        order = splatInstances[position].order;
+                return (int64_t) instanceKindInfo[instanceKind].depthRank << 32 | (int64_t) order;
+        }
+        UNREACHABLE();
+}
+
+/* Draw the built instances from position first to end in the drawing order */
+static void record_built_instances(int first, int end, int blendMode)
+{
+        int kindFirst = 0;
+        for (int i = 0; i < LENGTH(builtInstanceDrawingOrder); i++) {
+                int instanceKind = builtInstanceDrawingOrder[i].instanceKind;
+                int numInstances;
+                const char *instances = get_built_instances(instanceKind, &numInstances);
+                int a = first - kindFirst > 0 ? first - kindFirst : 0;
+                int b = end - kindFirst < numInstances ? end - kindFirst : numInstances;
+                if (a < b)
+                        record_instances(instanceKind, builtInstanceDrawingOrder[i].layer, blendMode,
+                                instances + (size_t) a * instanceKindInfo[instanceKind].instanceSize, b - a);
+                kindFirst += numInstances;
+        }
+}
+
+/* The world rectangle that is visible on the screen. It's the unprojection
+ * of the (-1,-1) x (1,1) clip space square. */
+static void compute_visible_world_rect(struct Rect *outRect)
+{
+        static const float corners[4][2] = {
+                { -1.0f, -1.0f }, { -1.0f, 1.0f }, { 1.0f, -1.0f }, { 1.0f, 1.0f },
+        };
+        for (int i = 0; i < 4; i++) {
+                float x = unprojMat[0][0] * corners[i][0] + unprojMat[0][1] * corners[i][1] + unprojMat[0][2];
+                float y = unprojMat[1][0] * corners[i][0] + unprojMat[1][1] * corners[i][1] + unprojMat[1][2];
+                if (i == 0 || x < outRect->minX) outRect->minX = x;
+                if (i == 0 || y < outRect->minY) outRect->minY = y;
+                if (i == 0 || x > outRect->maxX) outRect->maxX = x;
+                if (i == 0 || y > outRect->maxY) outRect->maxY = y;
+        }
+}
+
+/* draw a texture (or part of it) to a rectangle given in clip space */
+static void record_composite(int layer, GfxTexture gfxTexture, int blendMode, const struct Rect *destRect, const struct Rect *sourceRect)
+{
+        record_draw(&renderCommandList, layer, get_current_program_key(PROGRAM_COMPOSITE, 0), gfxVaoOfProgram[PROGRAM_COMPOSITE], blendMode, 0, LENGTH(unitQuadVerts), 0);
+        record_texture(&renderCommandList, gfxTexture);
+        record_uniform_4f(&renderCommandList, UNIFORM_COMPOSITE_destRect, destRect->minX, destRect->minY, destRect->maxX, destRect->maxY);
+        record_uniform_4f(&renderCommandList, UNIFORM_COMPOSITE_sourceRect, sourceRect->minX, sourceRect->minY, sourceRect->maxX, sourceRect->maxY);
+}
+
+/* The given objects from the instance mirror, over the cleared target. The
+ * fully covered pixels of the ellipses, rounded rectangles and circles are
+ * drawn first, without blending, writing depth. The edges and the splats are
+ * blended on top with depth testing, so a shape's edge doesn't get drawn
+ * where it is hidden by another shape. The order of the blended draws stays
+ * the same, so the picture is the same as with all shapes blended from back
+ * to front. If the objects span too many depth keys, that is what happens
+ * instead. */
+static void draw_scene(const Object *objectList, int numObjectsInList)
+{
+        static const struct MirrorPass opaqueEllipsePass = { RENDERLAYER_OPAQUE_ELLIPSES, 1 << SHADERFEATURE_OPAQUE_INTERIOR, BLEND_NONE, DEPTH_TEST_AND_WRITE, 1 };
+        static const struct MirrorPass opaqueCirclePass = { RENDERLAYER_OPAQUE_CIRCLES, 1 << SHADERFEATURE_OPAQUE_INTERIOR, BLEND_NONE, DEPTH_TEST_AND_WRITE, 1 };
+        static const struct MirrorPass opaqueRoundRectPass = { RENDERLAYER_OPAQUE_ROUNDRECTS, 1 << SHADERFEATURE_OPAQUE_INTERIOR, BLEND_NONE, DEPTH_TEST_AND_WRITE, 1 };
+        static const struct MirrorPass ellipseEdgePass = { RENDERLAYER_ELLIPSES, 1 << SHADERFEATURE_EDGE_BAND, BLEND_ALPHA, DEPTH_TEST, 0 };
+        static const struct MirrorPass roundRectEdgePass = { RENDERLAYER_ROUNDRECTS, 1 << SHADERFEATURE_EDGE_BAND, BLEND_ALPHA, DEPTH_TEST, 0 };
+        static const struct MirrorPass splatPass = { RENDERLAYER_SPLATS, 0, BLEND_ALPHA, DEPTH_TEST, 0 };
+        static const struct MirrorPass circleEdgePass = { RENDERLAYER_CIRCLES, 1 << SHADERFEATURE_EDGE_BAND, BLEND_ALPHA, DEPTH_TEST, 0 };
+        static const struct MirrorPass ellipsePass = { RENDERLAYER_ELLIPSES, 0, BLEND_ALPHA, DEPTH_NONE, 0 };
+        static const struct MirrorPass roundRectPass = { RENDERLAYER_ROUNDRECTS, 0, BLEND_ALPHA, DEPTH_NONE, 0 };
+        static const struct MirrorPass blendedSplatPass = { RENDERLAYER_SPLATS, 0, BLEND_ALPHA, DEPTH_NONE, 0 };
+        static const struct MirrorPass circlePass = { RENDERLAYER_CIRCLES, 0, BLEND_ALPHA, DEPTH_NONE, 0 };
+        int numRanges;
+
+        clear_current_buffer();
+        int isDepthUsable = set_depth_range(objectList, numObjectsInList);
+        numRanges = collect_mirror_ranges(objectList, numObjectsInList, INSTANCE_ELLIPSE);
+        if (isDepthUsable) {
+                record_mirror_ranges(numRanges, INSTANCE_ELLIPSE, &opaqueEllipsePass);
+                record_mirror_ranges(numRanges, INSTANCE_ELLIPSE, &ellipseEdgePass);
+        }
+        else
+                record_mirror_ranges(numRanges, INSTANCE_ELLIPSE, &ellipsePass);
+        numRanges = collect_mirror_ranges(objectList, numObjectsInList, INSTANCE_ROUNDRECT);
+        if (isDepthUsable) {
+                record_mirror_ranges(numRanges, INSTANCE_ROUNDRECT, &opaqueRoundRectPass);
+                record_mirror_ranges(numRanges, INSTANCE_ROUNDRECT, &roundRectEdgePass);
+        }
+        else
+                record_mirror_ranges(numRanges, INSTANCE_ROUNDRECT, &roundRectPass);
+        numRanges = collect_mirror_ranges(objectList, numObjectsInList, INSTANCE_SPLAT);
+        record_mirror_ranges(numRanges, INSTANCE_SPLAT, isDepthUsable ? &splatPass : &blendedSplatPass);
+        numRanges = collect_mirror_ranges(objectList, numObjectsInList, INSTANCE_CIRCLE);
+        if (isDepthUsable) {
+                record_mirror_ranges(numRanges, INSTANCE_CIRCLE, &opaqueCirclePass);
+                record_mirror_ranges(numRanges, INSTANCE_CIRCLE, &circleEdgePass);
+        }
+        else
+                record_mirror_ranges(numRanges, INSTANCE_CIRCLE, &circlePass);
+        set_depth_range(NULL, 0);
+        submit_RenderCommandList(&renderCommandList);
+}
+
+static void set_scene_scale(float scale)
+{
+        sceneScale = scale;
+        numSlowRedraws = 0;
+        numFastRedraws = 0;
+        firstCurrentScaleRedraw = numTimedRedraws;
+}
+
+/* Start measuring a redraw of the given fraction of the scene layer.
+ * Returns 0 if it doesn't get measured. */
+static int begin_redraw_timer(double fraction)
+{
+        if (!isDynamicResolutionEnabled || fraction < minTimedRedrawFraction || !begin_gpu_timer())
+                return 0;
+        timedRedrawFraction[numTimedRedraws % MAX_TIMED_REDRAWS_IN_FLIGHT] = fraction;
+        return 1;
+}
+
+static void end_redraw_timer(void)
+{
+        end_gpu_timer();
+        numTimedRedraws++;
+}
+
+/* Feed the measurements that came back to the scale decision */
+static void update_scene_scale(void)
+{
+        double seconds;
+        while (poll_gpu_timer(&seconds)) {
+                int redraw = numCollectedRedraws++;
+                if (redraw < firstCurrentScaleRedraw || !isDynamicResolutionEnabled)
+                        continue;
+                seconds /= timedRedrawFraction[redraw % MAX_TIMED_REDRAWS_IN_FLIGHT];
+                if (seconds > sceneBudgetSeconds) {
+                        numFastRedraws = 0;
+                        if (++numSlowRedraws >= numSlowRedrawsToScaleDown && sceneScale > minSceneScale) {
+                                set_scene_scale(fmaxf(sceneScale - sceneScaleStep, minSceneScale));
+                                log_postf("Scene scale is down to %.0f%% (%.1f ms)\n", sceneScale * 100.0f, seconds * 1000.0);
+                        }
+                }
+                else if (seconds < 0.5 * sceneBudgetSeconds) {
+                        numSlowRedraws = 0;
+                        if (++numFastRedraws >= numFastRedrawsToScaleUp && sceneScale < 1.0f) {
+                                set_scene_scale(fminf(sceneScale + sceneScaleStep, 1.0f));
+                                log_postf("Scene scale is up to %.0f%% (%.1f ms)\n", sceneScale * 100.0f, seconds * 1000.0);
+                        }
+                }
+                else {
+                        numSlowRedraws = 0;
+                        numFastRedraws = 0;
+                }
+        }
+        if (!isDynamicResolutionEnabled && sceneScale != 1.0f)
+                set_scene_scale(1.0f);
+}
+
+/* Resizing the scene layer throws its picture away */
+static void update_scene_layer_size(void)
+{
+        update_scene_scale();
+        int width = (int) (sceneScale * windowWidthInPixels + 0.5f);
+        int height = (int) (sceneScale * windowHeightInPixels + 0.5f);
+        if (width < 1) width = 1;
+        if (height < 1) height = 1;
+        if (sceneLayerWidth != width || sceneLayerHeight != height) {
+                sceneLayerWidth = width;
+                sceneLayerHeight = height;
+                set_GfxTexture_size(sceneLayerTexture, TEXTUREFORMAT_RGBA8_SRGB, sceneLayerWidth, sceneLayerHeight);
+                attach_GfxTexture_to_GfxFBO(sceneLayerTexture, sceneLayerFBO);
+                isSceneLayerValid = 0;
+        }
+}
+
+/* The dragged instances must be built. If one of them got to another place
+ * in the drawing order, because its level of detail changed, the cache is
+ * out of date. */
+static int are_dragged_instance_keys_current(void)
+{
+        if (get_num_built_instances() != numDragSegments - 1)
+                return 0;
+        for (int i = 0; i < numDragSegments - 1; i++)
+                if (get_built_instance_key(i) != draggedInstanceKeys[i])
+                        return 0;
+        return 1;
+}
+
+/* Render all visible objects except the dragged ones to the drag layers.
+ * Both lists are sorted, so we can filter in one go. Afterwards, the dragged
+ * instances are built again. */
+static void render_drag_cache(void)
+{
+        if (staticObjectsCapacity < numVisibleObjects) {
+                staticObjectsCapacity = numVisibleObjects;
+                REALLOC_MEMORY(&staticObjects, staticObjectsCapacity);
+        }
+        int numStaticObjects = 0;
+        int j = 0;
+        for (int i = 0; i < numVisibleObjects; i++) {
+                while (j < numDraggedObjects && draggedObjects[j] < visibleObjects[i])
+                        j++;
+                if (j < numDraggedObjects && draggedObjects[j] == visibleObjects[i])
+                        continue;
+                staticObjects[numStaticObjects++] = visibleObjects[i];
+        }
+
+        isDragCacheValid = 1;
+        dragCacheZoomFactor = zoomFactor;
+        dragCacheMatcap = isMatcapEnabled;
+        if (dragCacheWidth != sceneLayerWidth || dragCacheHeight != sceneLayerHeight) {
+                dragCacheWidth = sceneLayerWidth;
+                dragCacheHeight = sceneLayerHeight;
+                numSizedDragLayers = 0;
+        }
+
+        build_instances(draggedObjects, numDraggedObjects);
+        numDragSegments = get_num_built_instances() + 1;
+        if (dragSegmentsCapacity < numDragSegments) {
+                dragSegmentsCapacity = numDragSegments;
+                REALLOC_MEMORY(&dragLayerOfSegment, dragSegmentsCapacity);
+                REALLOC_MEMORY(&draggedInstanceKeys, dragSegmentsCapacity);
+        }
+        for (int i = 0; i < numDragSegments - 1; i++)
+                draggedInstanceKeys[i] = get_built_instance_key(i);
+
+        // segment i ends before dragged instance i
+        build_instances(staticObjects, numStaticObjects);
+        int numStaticInstances = get_num_built_instances();
+        int *segmentEnd;
+        ALLOC_MEMORY(&segmentEnd, numDragSegments);
+        int position = 0;
+        for (int i = 0; i < numDragSegments - 1; i++) {
+                while (position < numStaticInstances && get_built_instance_key(position) < draggedInstanceKeys[i])
+                        position++;
+                segmentEnd[i] = position;
+        }
+        segmentEnd[numDragSegments - 1] = numStaticInstances;
+        numDragLayers = 0;
+        for (int i = 0; i < numDragSegments; i++) {
+                int first = i > 0 ? segmentEnd[i - 1] : 0;
+                dragLayerOfSegment[i] = i == 0 || first < segmentEnd[i] ? numDragLayers++ : -1;
+        }
+
+        if (numDragLayers <= MAX_DRAG_LAYERS) {
+                int isTimed = begin_redraw_timer(1.0);
+                for (int i = 0; i < numDragSegments; i++) {
+                        int layer = dragLayerOfSegment[i];
+                        if (layer == -1)
+                                continue;
+                        if (layer >= numSizedDragLayers) {
+                                set_GfxTexture_size(dragLayerTexture[layer], TEXTUREFORMAT_RGBA8_SRGB, dragCacheWidth, dragCacheHeight);
+                                attach_GfxTexture_to_GfxFBO(dragLayerTexture[layer], dragLayerFBO[layer]);
+                                numSizedDragLayers = layer + 1;
+                        }
+                        bind_GfxFBO(dragLayerFBO[layer]);
+                        if (layer == 0)
+                                clear_current_buffer();
+                        else
+                                clear_current_buffer_transparent();
+                        record_built_instances(i > 0 ? segmentEnd[i - 1] : 0, segmentEnd[i], layer == 0 ? BLEND_ALPHA : BLEND_ALPHA_TO_LAYER);
+                        submit_RenderCommandList(&renderCommandList);
+                }
+                if (isTimed)
+                        end_redraw_timer();
+                bind_window_framebuffer();
+        }
+        FREE_MEMORY(&segmentEnd);
+        build_instances(draggedObjects, numDraggedObjects);
+}
+
+/* Draw a frame of the drag to the scene layer, which has the size of the
+ * drag cache. Returns 0 if the drag cache can't be used, then nothing was
+ * drawn. */
+static int draw_dragged_objects(void)
+{
+        update_scene_layer_size();
+        pixelsPerWorldUnit = projMat[0][0] * sceneLayerWidth / 2.0f;
+        build_instances(draggedObjects, numDraggedObjects);
+        if (!isDragCacheValid
+            || dragCacheWidth != sceneLayerWidth
+            || dragCacheHeight != sceneLayerHeight
+            || dragCacheZoomFactor != zoomFactor
+            || dragCacheMatcap != isMatcapEnabled
+            || !are_dragged_instance_keys_current())
+                render_drag_cache();
+        if (numDragLayers > MAX_DRAG_LAYERS)
+                return 0;
+        int isTimed = begin_redraw_timer(1.0);
+        bind_GfxFBO(sceneLayerFBO);
+        // The composites go to the bottom layer of the command list, so
+        // everything that comes before one has to be submitted first.
+        int firstDragged = 0;
+        for (int i = 0; i < numDragSegments; i++) {
+                int layer = dragLayerOfSegment[i];
+                if (layer == -1)
+                        continue;
+                if (layer > 0) {
+                        record_built_instances(firstDragged, i, BLEND_ALPHA);
+                        submit_RenderCommandList(&renderCommandList);
+                        firstDragged = i;
+                }
+                record_composite(RENDERLAYER_BACKGROUND, dragLayerTexture[layer], layer == 0 ? BLEND_NONE : BLEND_PREMULTIPLIED, &fullClipRect, &fullTexRect);
+        }
+        record_built_instances(firstDragged, numDragSegments - 1, BLEND_ALPHA);
+        submit_RenderCommandList(&renderCommandList);
+        if (isTimed)
+                end_redraw_timer();
+        bind_window_framebuffer();
+        // the tiles get composited to the layer again after the drag
+        isSceneLayerValid = 0;
+        return 1;
+}
+
+static void mark_tile_dirty(struct Tile *tile, int minX, int minY, int maxX, int maxY)
+{
+        if (minX < 0) minX = 0;
+        if (minY < 0) minY = 0;
+        if (maxX > TILE_SIZE) maxX = TILE_SIZE;
+        if (maxY > TILE_SIZE) maxY = TILE_SIZE;
+        if (minX >= maxX || minY >= maxY)
+                return;
+        if (tile->dirtyMinX >= tile->dirtyMaxX) {
+                tile->dirtyMinX = minX;
+                tile->dirtyMinY = minY;
+                tile->dirtyMaxX = maxX;
+                tile->dirtyMaxY = maxY;
+                return;
+        }
+        if (tile->dirtyMinX > minX) tile->dirtyMinX = minX;
+        if (tile->dirtyMinY > minY) tile->dirtyMinY = minY;
+        if (tile->dirtyMaxX < maxX) tile->dirtyMaxX = maxX;
+        if (tile->dirtyMaxY < maxY) tile->dirtyMaxY = maxY;
+}
+
+/* Apply the damage to the cached tiles and the minimap, and reset it */
+static void consume_damage(void)
+{
+        for (int i = 0; i < numTilePages * TILES_PER_PAGE; i++) {
+                struct Tile *tile = &tiles[i];
+                if (!tile->isUsed)
+                        continue;
+                if (isDamagedEverywhere) {
+                        mark_tile_dirty(tile, 0, 0, TILE_SIZE, TILE_SIZE);
+                        continue;
+                }
+                const struct Rect *w = &tile->worldRect;
+                float pixelsPerWorldUnitX = TILE_SIZE / (w->maxX - w->minX);
+                float pixelsPerWorldUnitY = TILE_SIZE / (w->maxY - w->minY);
+                for (int j = 0; j < numDamageRects; j++) {
+                        const struct Rect *r = &damageRects[j];
+                        int minX = (int) floorf((r->minX - w->minX) * pixelsPerWorldUnitX - damageMarginPixels);
+                        int minY = (int) floorf((r->minY - w->minY) * pixelsPerWorldUnitY - damageMarginPixels);
+                        int maxX = (int) ceilf((r->maxX - w->minX) * pixelsPerWorldUnitX + damageMarginPixels);
+                        int maxY = (int) ceilf((r->maxY - w->minY) * pixelsPerWorldUnitY + damageMarginPixels);
+                        mark_tile_dirty(tile, minX, minY, maxX, maxY);
+                }
+        }
+        reset_damage();
+}
+
+static void add_tile_page(void)
+{
+        numTilePages++;
+        REALLOC_MEMORY(&tilePages, numTilePages);
+        REALLOC_MEMORY(&tiles, numTilePages * TILES_PER_PAGE);
+        memset(&tiles[(numTilePages - 1) * TILES_PER_PAGE], 0, TILES_PER_PAGE * sizeof *tiles);
+        struct TilePage *page = &tilePages[numTilePages - 1];
+        page->gfxTexture = create_GfxTexture();
+        page->gfxFBO = create_GfxFBO();
+        set_GfxTexture_size(page->gfxTexture, TEXTUREFORMAT_RGBA8_SRGB, TILE_PAGE_SIZE, TILE_PAGE_SIZE);
+        attach_GfxTexture_to_GfxFBO(page->gfxTexture, page->gfxFBO);
+        set_GfxFBO_depth_size(page->gfxFBO, TILE_PAGE_SIZE, TILE_PAGE_SIZE);
+}
+
+/* The tile of the current level, or -1 if it isn't cached */
+static int find_tile(int tileX, int tileY)
+{
+        for (int i = 0; i < numTilePages * TILES_PER_PAGE; i++) {
+                const struct Tile *tile = &tiles[i];
+                if (tile->isUsed && tile->tileX == tileX && tile->tileY == tileY
+                    && tile->zoomFactor == zoomFactor
+                    && tile->levelWidth == sceneLayerWidth
+                    && tile->levelHeight == sceneLayerHeight)
+                        return i;
+        }
+        return -1;
+}
+
+/* Get a slot for a tile of the current level. The tiles that were used in
+ * the current frame don't get evicted, so if they fill the whole budget, a
+ * page gets added anyway. */
+static int allocate_tile(int tileX, int tileY)
+{
+        int best = -1;
+        for (int i = 0; i < numTilePages * TILES_PER_PAGE; i++) {
+                if (!tiles[i].isUsed) {
+                        best = i;
+                        break;
+                }
+                if (tiles[i].lastUsedFrame != tileFrame
+                    && (best == -1 || tiles[best].lastUsedFrame > tiles[i].lastUsedFrame))
+                        best = i;
+        }
+        if (best == -1 || tiles[best].isUsed) {
+                if (best == -1 || (numTilePages + 1) * tilePageBytes <= tileCacheBudgetBytes) {
+                        if ((numTilePages + 1) * tilePageBytes > tileCacheBudgetBytes)
+                                log_postf("The tile cache is over budget\n");
+                        best = numTilePages * TILES_PER_PAGE;
+                        add_tile_page();
+                }
+        }
+        struct Tile *tile = &tiles[best];
+        tile->isUsed = 1;
+        tile->zoomFactor = zoomFactor;
+        tile->levelWidth = sceneLayerWidth;
+        tile->levelHeight = sceneLayerHeight;
+        tile->tileX = tileX;
+        tile->tileY = tileY;
+        // the inverse of the pixel mapping in render_tile()
+        tile->worldRect.minX = ((2.0f * tileX * TILE_SIZE / sceneLayerWidth - 1.0f) - projMat[0][2]) / projMat[0][0];
+        tile->worldRect.minY = ((2.0f * tileY * TILE_SIZE / sceneLayerHeight - 1.0f) - projMat[1][2]) / projMat[1][1];
+        tile->worldRect.maxX = ((2.0f * (tileX + 1) * TILE_SIZE / sceneLayerWidth - 1.0f) - projMat[0][2]) / projMat[0][0];
+        tile->worldRect.maxY = ((2.0f * (tileY + 1) * TILE_SIZE / sceneLayerHeight - 1.0f) - projMat[1][2]) / projMat[1][1];
+        tile->dirtyMinX = 0;
+        tile->dirtyMinY = 0;
+        tile->dirtyMaxX = TILE_SIZE;
+        tile->dirtyMaxY = TILE_SIZE;
+        return best;
+}
+
+static void get_tile_slot_rect(int tileIndex, struct Rect *outRect)
+{
+        int slot = tileIndex % TILES_PER_PAGE;
+        outRect->minX = (float) (slot % TILES_PER_PAGE_ROW * TILE_SIZE);
+        outRect->minY = (float) (slot / TILES_PER_PAGE_ROW * TILE_SIZE);
+        outRect->maxX = outRect->minX + TILE_SIZE;
+        outRect->maxY = outRect->minY + TILE_SIZE;
+}
+
+/* Redraw the dirty part of a tile of the current level. The instance mirror
+ * must be up to date. */
+static void render_tile(int tileIndex)
+{
+        struct Tile *tile = &tiles[tileIndex];
+        const struct TilePage *page = &tilePages[tileIndex / TILES_PER_PAGE];
+        struct Rect slotRect;
+        get_tile_slot_rect(tileIndex, &slotRect);
+
+        // all objects that might touch a dirty pixel
+        const struct Rect *w = &tile->worldRect;
+        float worldUnitsPerPixelX = (w->maxX - w->minX) / TILE_SIZE;
+        float worldUnitsPerPixelY = (w->maxY - w->minY) / TILE_SIZE;
+        struct Rect selectRect = {
+                w->minX + (tile->dirtyMinX - damageMarginPixels) * worldUnitsPerPixelX,
+                w->minY + (tile->dirtyMinY - damageMarginPixels) * worldUnitsPerPixelY,
+                w->minX + (tile->dirtyMaxX + damageMarginPixels) * worldUnitsPerPixelX,
+                w->minY + (tile->dirtyMaxY + damageMarginPixels) * worldUnitsPerPixelY,
+        };
+        if (tileObjectsCapacity < numVisibleObjects) {
+                tileObjectsCapacity = numVisibleObjects;
+                REALLOC_MEMORY(&tileObjects, tileObjectsCapacity);
+        }
+        int numTileObjects = 0;
+        for (int i = 0; i < numVisibleObjects; i++) {
+                struct Rect bounds;
+                get_object_bounds(visibleObjects[i], &bounds);
+                if (test_rects_overlap(&bounds, &selectRect))
+                        tileObjects[numTileObjects++] = visibleObjects[i];
+        }
+
+        // Map the tile to clip space. The scene layer pixel p is at
+        // (p - tileX * TILE_SIZE) in the tile.
+        float sceneProjMat[3][3];
+        memcpy(sceneProjMat, projMat, sizeof projMat);
+        float sx = (float) sceneLayerWidth / TILE_SIZE;
+        float sy = (float) sceneLayerHeight / TILE_SIZE;
+        projMat[0][0] = sceneProjMat[0][0] * sx;
+        projMat[0][2] = (sceneProjMat[0][2] + 1.0f) * sx - 2.0f * tile->tileX - 1.0f;
+        projMat[1][1] = sceneProjMat[1][1] * sy;
+        projMat[1][2] = (sceneProjMat[1][2] + 1.0f) * sy - 2.0f * tile->tileY - 1.0f;
+
+        bind_GfxFBO(page->gfxFBO);
+        set_viewport((int) slotRect.minX, (int) slotRect.minY, TILE_SIZE, TILE_SIZE);
+        set_scissor_rect((int) slotRect.minX + tile->dirtyMinX, (int) slotRect.minY + tile->dirtyMinY,
+                tile->dirtyMaxX - tile->dirtyMinX, tile->dirtyMaxY - tile->dirtyMinY);
+        draw_scene(tileObjects, numTileObjects);
+        unset_scissor_rect();
+        memcpy(projMat, sceneProjMat, sizeof projMat);
+        tile->dirtyMinX = tile->dirtyMaxX = 0;
+}
+
+static void compute_overdraw_stats(struct OverdrawStats *stats)
+{
+        int numPixels = overdrawWidth * overdrawHeight;
+        int numCoveredPixels = 0;
+        read_current_buffer_float(0, 0, overdrawWidth, overdrawHeight, overdrawPixels);
+        memset(stats, 0, sizeof *stats);
+        for (int i = 0; i < numPixels; i++) {
+                int n = (int) (overdrawPixels[4 * i] + 0.5f);
+                if (n == 0)
+                        continue;
+                numCoveredPixels++;
+                stats->numFragments += n;
+                if (stats->maxPerPixel < n)
+                        stats->maxPerPixel = n;
+        }
+        if (numPixels > 0)
+                stats->meanPerPixel = (float) (stats->numFragments / numPixels);
+        if (numCoveredPixels > 0)
+                stats->meanPerCoveredPixel = (float) (stats->numFragments / numCoveredPixels);
+}
+
+/* Instead of the scene, show how many fragments each pixel gets from the
+ * visible objects. Every fragment of the bounding quads counts, also those
+ * that the shaders discard, because they cost as much fill rate. The counts
+ * are for the shapes drawn once each, like the streaming path does. The
+ * scene layer draws the shapes twice (see draw_scene()), but
+ * the depth test rejects most of the extra fragments before they get shaded. */
+static void draw_overdraw_heatmap(void)
+{
+        static const struct MirrorPass ellipsePass = { RENDERLAYER_ELLIPSES, 1 << SHADERFEATURE_OVERDRAW, BLEND_ADDITIVE, DEPTH_NONE, 0 };
+        static const struct MirrorPass roundRectPass = { RENDERLAYER_ROUNDRECTS, 1 << SHADERFEATURE_OVERDRAW, BLEND_ADDITIVE, DEPTH_NONE, 0 };
+        static const struct MirrorPass splatPass = { RENDERLAYER_SPLATS, 1 << SHADERFEATURE_OVERDRAW, BLEND_ADDITIVE, DEPTH_NONE, 0 };
+        static const struct MirrorPass circlePass = { RENDERLAYER_CIRCLES, 1 << SHADERFEATURE_OVERDRAW, BLEND_ADDITIVE, DEPTH_NONE, 0 };
+        int numRanges;
+
+        if (overdrawWidth != windowWidthInPixels || overdrawHeight != windowHeightInPixels) {
+                overdrawWidth = windowWidthInPixels;
+                overdrawHeight = windowHeightInPixels;
+                set_GfxTexture_size(overdrawTexture, TEXTUREFORMAT_RGBA16F, overdrawWidth, overdrawHeight);
+                attach_GfxTexture_to_GfxFBO(overdrawTexture, overdrawFBO);
+                REALLOC_MEMORY(&overdrawPixels, 4 * overdrawWidth * overdrawHeight);
+        }
+        update_instance_mirror();
+        bind_GfxFBO(overdrawFBO);
+        clear_current_buffer_transparent();
+        numRanges = collect_mirror_ranges(visibleObjects, numVisibleObjects, INSTANCE_ELLIPSE);
+        record_mirror_ranges(numRanges, INSTANCE_ELLIPSE, &ellipsePass);
+        numRanges = collect_mirror_ranges(visibleObjects, numVisibleObjects, INSTANCE_ROUNDRECT);
+        record_mirror_ranges(numRanges, INSTANCE_ROUNDRECT, &roundRectPass);
+        numRanges = collect_mirror_ranges(visibleObjects, numVisibleObjects, INSTANCE_SPLAT);
+        record_mirror_ranges(numRanges, INSTANCE_SPLAT, &splatPass);
+        numRanges = collect_mirror_ranges(visibleObjects, numVisibleObjects, INSTANCE_CIRCLE);
+        record_mirror_ranges(numRanges, INSTANCE_CIRCLE, &circlePass);
+        submit_RenderCommandList(&renderCommandList);
+
+        struct OverdrawStats stats;
+        compute_overdraw_stats(&stats);
+        if (stats.numFragments != loggedOverdrawStats.numFragments
+            || stats.maxPerPixel != loggedOverdrawStats.maxPerPixel) {
+                log_postf("Overdraw: %.0f fragments, %.2f per pixel, %.2f per covered pixel, at most %d\n",
+                        stats.numFragments, stats.meanPerPixel, stats.meanPerCoveredPixel, stats.maxPerPixel);
+                loggedOverdrawStats = stats;
+        }
+
+        bind_window_framebuffer();
+        record_draw(&renderCommandList, RENDERLAYER_BACKGROUND, get_current_program_key(PROGRAM_HEATMAP, 0), gfxVaoOfProgram[PROGRAM_HEATMAP], BLEND_NONE, 0, LENGTH(unitQuadVerts), 0);
+        record_texture(&renderCommandList, overdrawTexture);
+        record_uniform_4f(&renderCommandList, UNIFORM_HEATMAP_destRect, fullClipRect.minX, fullClipRect.minY, fullClipRect.maxX, fullClipRect.maxY);
+        record_uniform_4f(&renderCommandList, UNIFORM_HEATMAP_sourceRect, fullTexRect.minX, fullTexRect.minY, fullTexRect.maxX, fullTexRect.maxY);
+        record_uniform_1f(&renderCommandList, UNIFORM_HEATMAP_maxOverdraw, (float) stats.maxPerPixel);
+        submit_RenderCommandList(&renderCommandList);
+}
+
+/* Bring the scene layer up to date and consume the damage */
+static void update_scene_layer(void)
+{
+        update_scene_layer_size();
+        if (sceneLayerZoomFactor != zoomFactor) {
+                sceneLayerZoomFactor = zoomFactor;
+                isSceneLayerValid = 0;
+        }
+        consume_damage();
+        // the layer can be smaller than the window
+        pixelsPerWorldUnit = projMat[0][0] * sceneLayerWidth / 2.0f;
+
+        // Look up all tiles first, so that none of them gets evicted for
+        // another one.
+        int numTilesX = (sceneLayerWidth + TILE_SIZE - 1) / TILE_SIZE;
+        int numTilesY = (sceneLayerHeight + TILE_SIZE - 1) / TILE_SIZE;
+        int numSceneTiles = numTilesX * numTilesY;
+        if (sceneTilesCapacity < numSceneTiles) {
+                sceneTilesCapacity = numSceneTiles;
+                REALLOC_MEMORY(&sceneTiles, sceneTilesCapacity);
+        }
+        int numDirtyTiles = 0;
+        double numDirtyPixels = 0.0;
+        tileFrame++;
+        for (int i = 0; i < numSceneTiles; i++) {
+                int tileX = i % numTilesX;
+                int tileY = i / numTilesX;
+                int tileIndex = find_tile(tileX, tileY);
+                if (tileIndex == -1)
+                        tileIndex = allocate_tile(tileX, tileY);
+                struct Tile *tile = &tiles[tileIndex];
+                tile->lastUsedFrame = tileFrame;
+                if (tile->dirtyMinX < tile->dirtyMaxX) {
+                        numDirtyTiles++;
+                        numDirtyPixels += (double) (tile->dirtyMaxX - tile->dirtyMinX) * (tile->dirtyMaxY - tile->dirtyMinY);
+                }
+                sceneTiles[i] = tileIndex;
+        }
+
+        if (numDirtyTiles > 0) {
+                int isTimed = begin_redraw_timer(numDirtyPixels / ((double) numSceneTiles * TILE_SIZE * TILE_SIZE));
+                update_instance_mirror();
+                for (int i = 0; i < numSceneTiles; i++)
+                        if (tiles[sceneTiles[i]].dirtyMinX < tiles[sceneTiles[i]].dirtyMaxX)
+                                render_tile(sceneTiles[i]);
+                if (isTimed)
+                        end_redraw_timer();
+        }
+
+        if (!isSceneLayerValid || numDirtyTiles > 0) {
+                bind_GfxFBO(sceneLayerFBO);
+                for (int i = 0; i < numSceneTiles; i++) {
+                        const struct Tile *tile = &tiles[sceneTiles[i]];
+                        struct Rect slotRect;
+                        get_tile_slot_rect(sceneTiles[i], &slotRect);
+                        struct Rect destRect = {
+                                2.0f * tile->tileX * TILE_SIZE / sceneLayerWidth - 1.0f,
+                                2.0f * tile->tileY * TILE_SIZE / sceneLayerHeight - 1.0f,
+                                2.0f * (tile->tileX + 1) * TILE_SIZE / sceneLayerWidth - 1.0f,
+                                2.0f * (tile->tileY + 1) * TILE_SIZE / sceneLayerHeight - 1.0f,
+                        };
+                        struct Rect sourceRect = {
+                                slotRect.minX / TILE_PAGE_SIZE, slotRect.minY / TILE_PAGE_SIZE,
+                                slotRect.maxX / TILE_PAGE_SIZE, slotRect.maxY / TILE_PAGE_SIZE,
+                        };
+                        record_composite(RENDERLAYER_BACKGROUND, tilePages[sceneTiles[i] / TILES_PER_PAGE].gfxTexture, BLEND_NONE, &destRect, &sourceRect);
+                }
+                submit_RenderCommandList(&renderCommandList);
+                isSceneLayerValid = 1;
+        }
+        bind_window_framebuffer();
+}
+
+static void update_minimap(void)
+{
+        static const struct MirrorPass ellipsePass = { RENDERLAYER_ELLIPSES, 0, BLEND_ALPHA, DEPTH_NONE, 0 };
+        static const struct MirrorPass roundRectPass = { RENDERLAYER_ROUNDRECTS, 0, BLEND_ALPHA, DEPTH_NONE, 0 };
+        static const struct MirrorPass splatPass = { RENDERLAYER_SPLATS, 0, BLEND_ALPHA, DEPTH_NONE, 0 };
+        static const struct MirrorPass circlePass = { RENDERLAYER_CIRCLES, 1 << SHADERFEATURE_FLAT, BLEND_ALPHA, DEPTH_NONE, 0 };
+
+        int size = (int) (minimapSizeFraction * (windowWidthInPixels < windowHeightInPixels ? windowWidthInPixels : windowHeightInPixels));
+        if (size < 1)
+                size = 1;
+        if (minimapSize != size) {
+                minimapSize = size;
+                set_GfxTexture_size(minimapTexture, TEXTUREFORMAT_RGBA8_SRGB, minimapSize, minimapSize);
+                attach_GfxTexture_to_GfxFBO(minimapTexture, minimapFBO);
+                isMinimapValid = 0;
+        }
+        if (isMinimapValid && minimapContentVersion == sceneContentVersion)
+                return;
+        double now = get_time_in_seconds();
+        if (isMinimapValid && now - minimapUpdateTime < minimapUpdateIntervalSeconds) {
+                schedule_redraw(minimapUpdateTime + minimapUpdateIntervalSeconds);
+                return;
+        }
+
+        struct Rect bounds;
+        get_scene_bounds(&bounds);
+        float extent = 1.05f * fmaxf(bounds.maxX - bounds.minX, bounds.maxY - bounds.minY);
+        float centerX = 0.5f * (bounds.minX + bounds.maxX);
+        float centerY = 0.5f * (bounds.minY + bounds.maxY);
+
+        update_instance_mirror();
+        float sceneProjMat[3][3];
+        float scenePixelsPerWorldUnit = pixelsPerWorldUnit;
+        memcpy(sceneProjMat, projMat, sizeof projMat);
+        memset(projMat, 0, sizeof projMat);
+        projMat[0][0] = 2.0f / extent;
+        projMat[0][2] = -2.0f * centerX / extent;
+        projMat[1][1] = 2.0f / extent;
+        projMat[1][2] = -2.0f * centerY / extent;
+        projMat[2][2] = 1.0f;
+        pixelsPerWorldUnit = minimapSize / extent;
+        bind_GfxFBO(minimapFBO);
+        clear_current_buffer();
+        // all objects, at the level of detail of the minimap
+        int numRanges;
+        numRanges = collect_mirror_ranges(NULL, numObjects, INSTANCE_ELLIPSE);
+        record_mirror_ranges(numRanges, INSTANCE_ELLIPSE, &ellipsePass);
+        numRanges = collect_mirror_ranges(NULL, numObjects, INSTANCE_ROUNDRECT);
+        record_mirror_ranges(numRanges, INSTANCE_ROUNDRECT, &roundRectPass);
+        numRanges = collect_mirror_ranges(NULL, numObjects, INSTANCE_SPLAT);
+        record_mirror_ranges(numRanges, INSTANCE_SPLAT, &splatPass);
+        numRanges = collect_mirror_ranges(NULL, numObjects, INSTANCE_CIRCLE);
+        record_mirror_ranges(numRanges, INSTANCE_CIRCLE, &circlePass);
+        submit_RenderCommandList(&renderCommandList);
+        bind_window_framebuffer();
+        memcpy(projMat, sceneProjMat, sizeof projMat);
+        pixelsPerWorldUnit = scenePixelsPerWorldUnit;
+        isMinimapValid = 1;
+        minimapContentVersion = sceneContentVersion;
+        minimapUpdateTime = now;
+}
+
+/* in the upper right corner */
+static void record_minimap(void)
+{
+        float x0 = (float) (windowWidthInPixels - minimapMarginPixels - minimapSize);
+        float y0 = (float) (windowHeightInPixels - minimapMarginPixels - minimapSize);
+        struct Rect destRect = {
+                2.0f * x0 / windowWidthInPixels - 1.0f,
+                2.0f * y0 / windowHeightInPixels - 1.0f,
+                2.0f * (x0 + minimapSize) / windowWidthInPixels - 1.0f,
+                2.0f * (y0 + minimapSize) / windowHeightInPixels - 1.0f,
         };
-        int stateKind = get_object_state(ellipse);
-        const float *color = ellipseColors[stateKind];
-        set_GfxVBO_data(gfxVBO, &screenVerts, sizeof screenVerts);
-        set_program_uniform_mat3f(gfxProgram[PROGRAM_ELLIPSE], uniformLocation[UNIFORM_ELLIPSE_projMat], &projMat[0][0]);
-        set_program_uniform_2f(gfxProgram[PROGRAM_ELLIPSE], uniformLocation[UNIFORM_ELLIPSE_p0], ellipseControlPoints[0].x, ellipseControlPoints[0].y);
-        set_program_uniform_2f(gfxProgram[PROGRAM_ELLIPSE], uniformLocation[UNIFORM_ELLIPSE_p1], ellipseControlPoints[1].x, ellipseControlPoints[1].y);
-        set_program_uniform_1f(gfxProgram[PROGRAM_ELLIPSE], uniformLocation[UNIFORM_ELLIPSE_radius], e->radius);
-        set_program_uniform_3f(gfxProgram[PROGRAM_ELLIPSE], uniformLocation[UNIFORM_ELLIPSE_color], color[0], color[1], color[2]);
-        render_with_GfxProgram(gfxProgram[PROGRAM_ELLIPSE], gfxVaoOfProgram[PROGRAM_ELLIPSE], 0, LENGTH(screenVerts));
-}
-
-static void draw_point(Object obj)
-{
-        struct Circle *circle = &objects[obj].data.tCircle;
-        float x = circle->centerX;
-        float y = circle->centerY;
-        float radius = circle->radius;
-        float xa = x - 2.f * radius;
-        float xb = x + 2.f * radius;
-        float ya = y - 2.f * radius;
-        float yb = y + 2.f * radius;
-        const struct Vec2 smallVerts[] = {
-                { xa, ya }, { xa, yb }, { xb, yb },
-                { xa, ya }, { xb, yb }, { xb, ya }
-        };        
-        int stateKind = get_object_state(obj);
-        const float *color = circleColors[stateKind];
-        set_GfxVBO_data(gfxVBO, &smallVerts, sizeof smallVerts);
-        set_program_uniform_mat3f(gfxProgram[PROGRAM_CIRCLE], uniformLocation[UNIFORM_CIRCLE_projMat], &projMat[0][0]);
-        set_program_uniform_2f(gfxProgram[PROGRAM_CIRCLE], uniformLocation[UNIFORM_CIRCLE_centerPoint], x, y);
-        set_program_uniform_1f(gfxProgram[PROGRAM_CIRCLE], uniformLocation[UNIFORM_CIRCLE_radius], radius);
-        set_program_uniform_3f(gfxProgram[PROGRAM_CIRCLE], uniformLocation[UNIFORM_CIRCLE_color], color[0], color[1], color[2]);
-        render_with_GfxProgram(gfxProgram[PROGRAM_CIRCLE], gfxVaoOfProgram[PROGRAM_CIRCLE], 0, LENGTH(screenVerts));
+        record_composite(RENDERLAYER_OVERLAY, minimapTexture, BLEND_NONE, &destRect, &fullTexRect);
+}
+
+static void build_label_glyphs(void)
+{
+        if (labelObjectsCapacity < numObjects) {
+                labelObjectsCapacity = numObjects;
+                REALLOC_MEMORY(&labelFirstGlyph, labelObjectsCapacity);
+                REALLOC_MEMORY(&labelNumGlyphs, labelObjectsCapacity);
+        }
+        begin_text_batch();
+        numLabelGlyphs = 0;
+        for (Object obj = 0; obj < numObjects; obj++) {
+                labelFirstGlyph[obj] = numLabelGlyphs;
+                labelNumGlyphs[obj] = 0;
+                if (objects[obj].label == NULL)
+                        continue;
+                const struct GlyphQuad *quads;
+                float width;
+                int numQuads = layout_text(objects[obj].label, labelFontSize, &quads, &width);
+                if (labelGlyphsCapacity < numLabelGlyphs + numQuads) {
+                        labelGlyphsCapacity = 2 * (numLabelGlyphs + numQuads);
+                        REALLOC_MEMORY(&labelGlyphs, labelGlyphsCapacity);
+                }
+                float x, y;
+                get_object_position(obj, &x, &y);
+                for (int i = 0; i < numQuads; i++) {
+                        struct GlyphInstance *g = &labelGlyphs[numLabelGlyphs + i];
+                        g->anchor[0] = x;
+                        g->anchor[1] = y;
+                        // centered on the anchor. The baseline is a bit
+                        // below, so that capitals look centered.
+                        g->offset[0] = quads[i].offset[0] - 0.5f * width;
+                        g->offset[1] = quads[i].offset[1] - 0.35f * labelFontSize;
+                        g->size[0] = quads[i].size[0];
+                        g->size[1] = quads[i].size[1];
+                        for (int k = 0; k < 4; k++)
+                                g->texRect[k] = quads[i].texRect[k];
+                        for (int k = 0; k < 3; k++)
+                                g->color[k] = labelColor[k];
+                }
+                numLabelGlyphs += numQuads;
+                labelNumGlyphs[obj] = numQuads;
+        }
+        set_GfxVBO_data(labelVBO, labelGlyphs, numLabelGlyphs * sizeof *labelGlyphs);
+}
+
+/* Must be called before the instance mirror consumes the dirty objects */
+static void update_labels(void)
+{
+        if (!is_text_available())
+                return;
+        if (!isLabelBufferValid
+            || labelStructureVersion != sceneStructureVersion
+            || labelTextVersion != labelVersion) {
+                build_label_glyphs();
+                isLabelBufferValid = 1;
+                labelStructureVersion = sceneStructureVersion;
+                labelTextVersion = labelVersion;
+                return;
+        }
+        for (int i = 0; i < numDirtyObjects; i++) {
+                Object obj = dirtyObjects[i];
+                if (labelNumGlyphs[obj] == 0)
+                        continue;
+                float x, y;
+                get_object_position(obj, &x, &y);
+                struct GlyphInstance *first = &labelGlyphs[labelFirstGlyph[obj]];
+                for (int j = 0; j < labelNumGlyphs[obj]; j++) {
+                        first[j].anchor[0] = x;
+                        first[j].anchor[1] = y;
+                }
+                set_GfxVBO_subdata(labelVBO, labelFirstGlyph[obj] * sizeof *labelGlyphs, first, labelNumGlyphs[obj] * sizeof *labelGlyphs);
+        }
+}
+
+static void record_labels(void)
+{
+        if (numLabelGlyphs == 0)
+                return;
+        record_draw(&renderCommandList, RENDERLAYER_LABELS, get_current_program_key(PROGRAM_TEXT, 0), gfxVaoOfProgram[PROGRAM_TEXT], BLEND_ALPHA, 0, LENGTH(unitQuadVerts), numLabelGlyphs);
+        record_texture(&renderCommandList, get_text_atlas_texture());
+        record_uniform_mat3f(&renderCommandList, UNIFORM_TEXT_projMat, &projMat[0][0]);
 }
 
 void draw_shapes(void)
 {
+        bind_window_framebuffer();
         clear_current_buffer();
         float ratio = (float) windowWidthInPixels / windowHeightInPixels;
         projMat[0][0] = zoomFactor * 2.0f;
@@ -368,25 +2608,37 @@ void draw_shapes(void)
         unprojMat[2][1] = 0.0f;
         unprojMat[2][2] = 1.0f;
 
-        {
-        // two triangles covering the whole screen
-        static const struct Vec2 screenVerts[] = {
-                { -1.0f, -1.0f },
-                { -1.0f, 1.0f },
-                { 1.0f, 1.0f },
-                { -1.0f, -1.0f },
-                { 1.0f, -1.0f },
-                { 1.0f, 1.0f },
-        };
-        clear_current_buffer();
-        set_GfxVBO_data(gfxVBO, &screenVerts, sizeof screenVerts);
-        render_with_GfxProgram(gfxProgram[PROGRAM_TEST], gfxVaoOfProgram[PROGRAM_TEST], 0, LENGTH(screenVerts));
-        }
+        compute_visible_world_rect(&visibleWorldRect);
+        cull_objects(&visibleWorldRect);
+        // the projection is uniform, so we only need to look at one axis
+        pixelsPerWorldUnit = projMat[0][0] * windowWidthInPixels / 2.0f;
+        update_labels();
 
-        for (Object i = 0; i < numObjects; i++)
-                if (objects[i].objectKind == OBJECT_ELLIPSE)
-                        draw_ellipse(i);
-        for (Object i = 0; i < numObjects; i++)
-                if (objects[i].objectKind == OBJECT_CIRCLE)
-                        draw_point(i);
+        // The heat map doesn't keep the scene layer and the drag cache up to
+        // date, so they get redrawn after it is turned off.
+        if (isOverdrawHeatmapEnabled) {
+                isDragCacheValid = 0;
+                isSceneLayerValid = 0;
+                consume_damage();
+                draw_overdraw_heatmap();
+        }
+        // While dragging, the damage keeps accumulating. The scene layer
+        // gets patched up after the drag.
+        // The minimap gets updated after the drag, too.
+        else if (isDraggingObject && draw_dragged_objects()) {
+                record_composite(RENDERLAYER_BACKGROUND, sceneLayerTexture, BLEND_NONE, &fullClipRect, &fullTexRect);
+                record_labels();
+                if (minimapSize > 0)
+                        record_minimap();
+                submit_RenderCommandList(&renderCommandList);
+        }
+        else {
+                isDragCacheValid = 0;
+                update_scene_layer();
+                update_minimap();
+                record_composite(RENDERLAYER_BACKGROUND, sceneLayerTexture, BLEND_NONE, &fullClipRect, &fullTexRect);
+                record_labels();
+                record_minimap();
+                submit_RenderCommandList(&renderCommandList);
+        }
 }
@@ -0,0 +1,658 @@
+#include <shapes/defs.h>
+#include <shapes/gfxrender.h>
+#include <shapes/logging.h>
+#include <shapes/memoryalloc.h>
+#include <shapes/text.h>
+#include <shapes/workers.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_OUTLINE_H
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+        TEXT_ATLAS_SIZE = 512,
+        GLYPH_PADDING = 1,  // empty pixels around each glyph, against bleeding when filtering
+        SDF_PIXEL_SIZE = 32,  // size of the em square of the distance fields
+        SDF_SPREAD = 4,  // distance in pixels over which the field goes from 0.5 to 0 or 1
+        CURVE_SEGMENTS = 8,  // line segments per curve when flattening outlines
+        SHELF_HEIGHT_STEP = 4,
+        MAX_ATLAS_GLYPHS = 2048,
+        NUM_GLYPH_BUCKETS = 1024,
+        MAX_TEXT_RUNS = 1024,
+        NUM_RUN_BUCKETS = 512,
+};
+
+/* The font that is used is the first of these that can be loaded. The
+ * SHAPES_FONT environment variable comes before all of them. */
+static const char *const fontSearchPaths[] = {
+        "fonts/DejaVuSans.ttf",
+        "C:/Windows/Fonts/segoeui.ttf",
+        "C:/Windows/Fonts/arial.ttf",
+        "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf",
+        "/usr/share/fonts/TTF/DejaVuSans.ttf",
+        "/usr/share/fonts/dejavu/DejaVuSans.ttf",
+        "/usr/share/fonts/dejavu-sans-fonts/DejaVuSans.ttf",
+        "/usr/share/fonts/truetype/liberation/LiberationSans-Regular.ttf",
+        "/System/Library/Fonts/Helvetica.ttc",
+        "/Library/Fonts/Arial.ttf",
+};
+
+struct Shelf {
+        int y;
+        int height;
+        int usedWidth;
+        int lastUsedBatch;
+};
+
+/* A glyph that is in the atlas. Lengths are in pixels of SDF_PIXEL_SIZE. */
+struct AtlasGlyph {
+        unsigned glyphIndex;
+        int shelf;  // -1 if the glyph has no outline
+        int x;  // of the distance field (without padding) in the atlas
+        int y;
+        int width;
+        int height;
+        int originX;  // of the lower left corner of the distance field from the pen origin
+        int originY;
+        int nextInBucket;  // -1 at the end. Also links the free entries
+};
+
+struct Vec2f {
+        float x;
+        float y;
+};
+
+struct Segment {
+        struct Vec2f a;
+        struct Vec2f b;
+};
+
+/* Making the distance field of a glyph. The outline gets flattened to line
+ * segments first, because FreeType must not be used from several threads.
+ * The distance fields are then computed in parallel. */
+struct SdfJob {
+        unsigned glyphIndex;
+        struct Segment *segments;
+        int numSegments;
+        int segmentsCapacity;
+        struct Vec2f lastPoint;
+        int originX;
+        int originY;
+        int width;
+        int height;
+        unsigned char *pixels;  // top row first
+};
+
+/* A laid out string. Lengths are in pixels of SDF_PIXEL_SIZE. */
+struct RunGlyph {
+        unsigned glyphIndex;
+        float penX;
+};
+
+struct TextRun {
+        char *text;
+        unsigned hash;
+        struct RunGlyph *glyphs;
+        int numGlyphs;
+        float width;
+        int lastUsedBatch;
+        int nextInBucket;
+};
+
+static int isTextAvailable;
+static FT_Library ftLibrary;
+static FT_Face ftFace;
+
+static GfxTexture atlasTexture;
+static struct Shelf *shelves;
+static int numShelves;
+static int nextShelfY;
+static struct AtlasGlyph atlasGlyphs[MAX_ATLAS_GLYPHS];
+static int glyphBuckets[NUM_GLYPH_BUCKETS];
+static int firstFreeGlyph;
+static int currentBatch;
+static int isAtlasFullLogged;
+static unsigned char *glyphPixels;  // scratch space for padding a glyph
+static int glyphPixelsCapacity;
+
+static struct TextRun textRuns[MAX_TEXT_RUNS];
+static int numTextRuns;
+static int runBuckets[NUM_RUN_BUCKETS];
+
+static struct GlyphQuad *layoutQuads;
+static int layoutQuadsCapacity;
+static struct SdfJob *sdfJobs;
+static int sdfJobsCapacity;
+static unsigned *missingGlyphs;
+
+static unsigned hash_glyph(unsigned glyphIndex)
+{
+        return glyphIndex * 2654435761u;
+}
+
+static unsigned hash_text(const char *text)
+{
+        // FNV-1a
+        unsigned h = 2166136261u;
+        for (const unsigned char *p = (const unsigned char *) text; *p; p++) {
+                h ^= *p;
+                h *= 16777619u;
+        }
+        return h;
+}
+
+/* Returns the next code point and advances *text. Invalid bytes are decoded
+ * as U+FFFD. */
+static unsigned decode_utf8(const char **text)
+{
+        const unsigned char *p = (const unsigned char *) *text;
+        unsigned c = p[0];
+        int n = c < 0x80 ? 0 : c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : -1;
+        if (n < 0) {
+                *text += 1;
+                return 0xFFFD;
+        }
+        c &= 0x7F >> n;
+        for (int i = 1; i <= n; i++) {
+                if ((p[i] & 0xC0) != 0x80) {
+                        *text += i;
+                        return 0xFFFD;
+                }
+                c = (c << 6) | (p[i] & 0x3F);
+        }
+        *text += n + 1;
+        return c;
+}
+
+static void evict_shelf(int shelf)
+{
+        for (int b = 0; b < NUM_GLYPH_BUCKETS; b++) {
+                int *link = &glyphBuckets[b];
+                while (*link != -1) {
+                        struct AtlasGlyph *glyph = &atlasGlyphs[*link];
+                        if (glyph->shelf == shelf) {
+                                int g = *link;
+                                *link = glyph->nextInBucket;
+                                glyph->nextInBucket = firstFreeGlyph;
+                                firstFreeGlyph = g;
+                        }
+                        else
+                                link = &glyph->nextInBucket;
+                }
+        }
+        shelves[shelf].usedWidth = 0;
+}
+
+static int add_shelf(int height)
+{
+        int shelfHeight = (height + SHELF_HEIGHT_STEP - 1) / SHELF_HEIGHT_STEP * SHELF_HEIGHT_STEP;
+        if (nextShelfY + shelfHeight > TEXT_ATLAS_SIZE)
+                return -1;
+        int shelf = numShelves++;
+        REALLOC_MEMORY(&shelves, numShelves);
+        shelves[shelf].y = nextShelfY;
+        shelves[shelf].height = shelfHeight;
+        shelves[shelf].usedWidth = 0;
+        shelves[shelf].lastUsedBatch = currentBatch;
+        nextShelfY += shelfHeight;
+        return shelf;
+}
+
+/* Find space for a rectangle of the given size (with padding) and return
+ * the shelf, or -1 if there is none. Shelves that were used in the current
+ * batch don't get evicted. */
+static int allocate_in_atlas(int width, int height, int *outX)
+{
+        int bestShelf = -1;
+        for (int i = 0; i < numShelves; i++) {
+                // don't waste too much of a shelf on smaller glyphs
+                if (shelves[i].height < height || shelves[i].height > height + height / 4 + SHELF_HEIGHT_STEP)
+                        continue;
+                if (shelves[i].usedWidth + width > TEXT_ATLAS_SIZE)
+                        continue;
+                if (bestShelf == -1 || shelves[i].height < shelves[bestShelf].height)
+                        bestShelf = i;
+        }
+        if (bestShelf == -1)
+                bestShelf = add_shelf(height);
+        if (bestShelf == -1) {
+                // evict the least recently used shelf that is high enough
+                for (int i = 0; i < numShelves; i++) {
+                        if (shelves[i].height < height || shelves[i].lastUsedBatch == currentBatch)
+                                continue;
+                        if (bestShelf == -1 || shelves[i].lastUsedBatch < shelves[bestShelf].lastUsedBatch)
+                                bestShelf = i;
+                }
+                if (bestShelf != -1)
+                        evict_shelf(bestShelf);
+        }
+        if (bestShelf == -1) {
+                // None is high enough. Drop the unused shelves at the bottom
+                // of the atlas to make room for a new one.
+                while (numShelves > 0 && shelves[numShelves - 1].lastUsedBatch != currentBatch) {
+                        evict_shelf(numShelves - 1);
+                        numShelves--;
+                        nextShelfY = shelves[numShelves].y;
+                }
+                bestShelf = add_shelf(height);
+                if (bestShelf == -1)
+                        return -1;
+        }
+        *outX = shelves[bestShelf].usedWidth;
+        shelves[bestShelf].usedWidth += width;
+        return bestShelf;
+}
+
+static struct AtlasGlyph *find_atlas_glyph(unsigned glyphIndex)
+{
+        for (int g = glyphBuckets[hash_glyph(glyphIndex) % NUM_GLYPH_BUCKETS]; g != -1; g = atlasGlyphs[g].nextInBucket) {
+                struct AtlasGlyph *glyph = &atlasGlyphs[g];
+                if (glyph->glyphIndex == glyphIndex) {
+                        if (glyph->shelf != -1)
+                                shelves[glyph->shelf].lastUsedBatch = currentBatch;
+                        return glyph;
+                }
+        }
+        return NULL;
+}
+
+static void add_segment(struct SdfJob *job, struct Vec2f b)
+{
+        if (job->segmentsCapacity <= job->numSegments) {
+                job->segmentsCapacity = 2 * job->segmentsCapacity + 32;
+                REALLOC_MEMORY(&job->segments, job->segmentsCapacity);
+        }
+        job->segments[job->numSegments].a = job->lastPoint;
+        job->segments[job->numSegments].b = b;
+        job->numSegments++;
+        job->lastPoint = b;
+}
+
+static struct Vec2f make_point(const FT_Vector *v)
+{
+        struct Vec2f p = { v->x / 64.0f, v->y / 64.0f };
+        return p;
+}
+
+static int move_to(const FT_Vector *to, void *user)
+{
+        struct SdfJob *job = user;
+        job->lastPoint = make_point(to);
+        return 0;
+}
+
+static int line_to(const FT_Vector *to, void *user)
+{
+        add_segment(user, make_point(to));
+        return 0;
+}
+
+static int conic_to(const FT_Vector *control, const FT_Vector *to, void *user)
+{
+        struct SdfJob *job = user;
+        struct Vec2f p0 = job->lastPoint;
+        struct Vec2f p1 = make_point(control);
+        struct Vec2f p2 = make_point(to);
+        for (int i = 1; i <= CURVE_SEGMENTS; i++) {
+                float t = (float) i / CURVE_SEGMENTS;
+                float s = 1.0f - t;
+                struct Vec2f p = {
+                        s * s * p0.x + 2.0f * s * t * p1.x + t * t * p2.x,
+                        s * s * p0.y + 2.0f * s * t * p1.y + t * t * p2.y,
+                };
+                add_segment(job, p);
+        }
+        return 0;
+}
+
+static int cubic_to(const FT_Vector *control1, const FT_Vector *control2, const FT_Vector *to, void *user)
+{
+        struct SdfJob *job = user;
+        struct Vec2f p0 = job->lastPoint;
+        struct Vec2f p1 = make_point(control1);
+        struct Vec2f p2 = make_point(control2);
+        struct Vec2f p3 = make_point(to);
+        for (int i = 1; i <= CURVE_SEGMENTS; i++) {
+                float t = (float) i / CURVE_SEGMENTS;
+                float s = 1.0f - t;
+                struct Vec2f p = {
+                        s * s * s * p0.x + 3.0f * s * s * t * p1.x + 3.0f * s * t * t * p2.x + t * t * t * p3.x,
+                        s * s * s * p0.y + 3.0f * s * s * t * p1.y + 3.0f * s * t * t * p2.y + t * t * t * p3.y,
+                };
+                add_segment(job, p);
+        }
+        return 0;
+}
+
+static const FT_Outline_Funcs outlineFuncs = { &move_to, &line_to, &conic_to, &cubic_to, 0, 0 };
+
+/* Flatten the outline of the glyph and find the size of its distance field.
+ * Leaves the size 0 if there is nothing to draw. */
+static void prepare_sdf_job(struct SdfJob *job)
+{
+        job->numSegments = 0;
+        job->width = 0;
+        job->height = 0;
+        if (FT_Load_Glyph(ftFace, job->glyphIndex, FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP) != 0)
+                return;
+        FT_Outline *outline = &ftFace->glyph->outline;
+        if (ftFace->glyph->format != FT_GLYPH_FORMAT_OUTLINE || outline->n_points == 0)
+                return;
+        FT_Outline_Decompose(outline, &outlineFuncs, job);
+        FT_BBox box;
+        FT_Outline_Get_CBox(outline, &box);
+        job->originX = (int) floorf(box.xMin / 64.0f) - SDF_SPREAD;
+        job->originY = (int) floorf(box.yMin / 64.0f) - SDF_SPREAD;
+        job->width = (int) ceilf(box.xMax / 64.0f) + SDF_SPREAD - job->originX;
+        job->height = (int) ceilf(box.yMax / 64.0f) + SDF_SPREAD - job->originY;
+}
+
+static float get_distance_to_segment(struct Vec2f p, const struct Segment *s)
+{
+        float dx = s->b.x - s->a.x;
+        float dy = s->b.y - s->a.y;
+        float lengthSquared = dx * dx + dy * dy;
+        float t = lengthSquared > 0.0f ? ((p.x - s->a.x) * dx + (p.y - s->a.y) * dy) / lengthSquared : 0.0f;
+        t = t < 0.0f ? 0.0f : t > 1.0f ? 1.0f : t;
+        float ex = s->a.x + t * dx - p.x;
+        float ey = s->a.y + t * dy - p.y;
+        return sqrtf(ex * ex + ey * ey);
+}
+
+/* A worker function: computes the distance field of one glyph. The sign comes
+ * from the winding number (TrueType and CFF fonts use the nonzero rule), found
+ * by casting a ray to the right. */
+static void compute_sdf(void *arg, int jobIndex, int numJobs)
+{
+        UNUSED(numJobs);
+        struct SdfJob *job = &((struct SdfJob *) arg)[jobIndex];
+        for (int row = 0; row < job->height; row++) {
+                for (int col = 0; col < job->width; col++) {
+                        struct Vec2f p = {
+                                job->originX + col + 0.5f,
+                                job->originY + job->height - row - 0.5f,
+                        };
+                        float distance = 1e30f;
+                        int winding = 0;
+                        for (int i = 0; i < job->numSegments; i++) {
+                                const struct Segment *s = &job->segments[i];
+                                float d = get_distance_to_segment(p, s);
+                                if (d < distance)
+                                        distance = d;
+                                if ((s->a.y <= p.y) != (s->b.y <= p.y)) {
+                                        float x = s->a.x + (p.y - s->a.y) * (s->b.x - s->a.x) / (s->b.y - s->a.y);
+                                        if (x > p.x)
+                                                winding += s->b.y > s->a.y ? 1 : -1;
+                                }
+                        }
+                        float value = 0.5f + (winding != 0 ? distance : -distance) / (2.0f * SDF_SPREAD);
+                        value = value < 0.0f ? 0.0f : value > 1.0f ? 1.0f : value;
+                        job->pixels[row * job->width + col] = (unsigned char) (value * 255.0f + 0.5f);
+                }
+        }
+}
+
+/* Put a finished distance field into the atlas. Returns 0 if it doesn't
+ * fit. */
+static int add_atlas_glyph(const struct SdfJob *job)
+{
+        int shelf = -1;
+        int x = 0;
+        int paddedWidth = job->width + 2 * GLYPH_PADDING;
+        int paddedHeight = job->height + 2 * GLYPH_PADDING;
+        if (firstFreeGlyph == -1) {
+                // Evicting a shelf would free some entries, but with this
+                // many glyphs, the atlas itself is the limit in practice.
+                if (!isAtlasFullLogged) {
+                        log_postf("Too many glyphs in the text atlas. Some glyphs are not drawn.");
+                        isAtlasFullLogged = 1;
+                }
+                return 0;
+        }
+        if (job->width > 0) {
+                shelf = allocate_in_atlas(paddedWidth, paddedHeight, &x);
+                if (shelf == -1) {
+                        if (!isAtlasFullLogged) {
+                                log_postf("The text atlas is full. Some glyphs are not drawn.");
+                                isAtlasFullLogged = 1;
+                        }
+                        return 0;
+                }
+        }
+        int g = firstFreeGlyph;
+        struct AtlasGlyph *glyph = &atlasGlyphs[g];
+        firstFreeGlyph = glyph->nextInBucket;
+        unsigned bucket = hash_glyph(job->glyphIndex) % NUM_GLYPH_BUCKETS;
+        glyph->glyphIndex = job->glyphIndex;
+        glyph->shelf = shelf;
+        glyph->x = x + GLYPH_PADDING;
+        glyph->y = shelf == -1 ? 0 : shelves[shelf].y + GLYPH_PADDING;
+        glyph->width = job->width;
+        glyph->height = job->height;
+        glyph->originX = job->originX;
+        glyph->originY = job->originY;
+        glyph->nextInBucket = glyphBuckets[bucket];
+        glyphBuckets[bucket] = g;
+
+        if (shelf != -1) {
+                shelves[shelf].lastUsedBatch = currentBatch;
+                // upload with the padding, so that the stale pixels of an
+                // evicted glyph get cleared
+                if (glyphPixelsCapacity < paddedWidth * paddedHeight) {
+                        glyphPixelsCapacity = paddedWidth * paddedHeight;
+                        REALLOC_MEMORY(&glyphPixels, glyphPixelsCapacity);
+                }
+                memset(glyphPixels, 0, paddedWidth * paddedHeight);
+                for (int row = 0; row < job->height; row++)
+                        memcpy(&glyphPixels[(row + GLYPH_PADDING) * paddedWidth + GLYPH_PADDING],
+                               &job->pixels[row * job->width], job->width);
+                set_GfxTexture_subdata(atlasTexture, TEXTUREFORMAT_R8, x, shelves[shelf].y, paddedWidth, paddedHeight, glyphPixels);
+        }
+        return 1;
+}
+
+/* Make the distance fields of the glyphs and put them into the atlas */
+static void generate_glyphs(const unsigned *glyphIndices, int numGlyphs)
+{
+        if (sdfJobsCapacity < numGlyphs) {
+                int oldCapacity = sdfJobsCapacity;
+                sdfJobsCapacity = numGlyphs;
+                REALLOC_MEMORY(&sdfJobs, sdfJobsCapacity);
+                memset(&sdfJobs[oldCapacity], 0, (sdfJobsCapacity - oldCapacity) * sizeof *sdfJobs);
+        }
+        for (int i = 0; i < numGlyphs; i++) {
+                struct SdfJob *job = &sdfJobs[i];
+                job->glyphIndex = glyphIndices[i];
+                prepare_sdf_job(job);
+                ALLOC_MEMORY(&job->pixels, job->width * job->height + 1);
+        }
+        run_parallel(&compute_sdf, sdfJobs, numGlyphs);
+        for (int i = 0; i < numGlyphs; i++) {
+                add_atlas_glyph(&sdfJobs[i]);
+                FREE_MEMORY(&sdfJobs[i].pixels);
+        }
+}
+
+static void free_text_run(int run)
+{
+        struct TextRun *r = &textRuns[run];
+        int *link = &runBuckets[r->hash % NUM_RUN_BUCKETS];
+        while (*link != run)
+                link = &textRuns[*link].nextInBucket;
+        *link = r->nextInBucket;
+        FREE_MEMORY(&r->text);
+        FREE_MEMORY(&r->glyphs);
+}
+
+static const struct TextRun *get_text_run(const char *text)
+{
+        unsigned hash = hash_text(text);
+        unsigned bucket = hash % NUM_RUN_BUCKETS;
+        for (int i = runBuckets[bucket]; i != -1; i = textRuns[i].nextInBucket) {
+                struct TextRun *r = &textRuns[i];
+                if (r->hash == hash && !strcmp(r->text, text)) {
+                        r->lastUsedBatch = currentBatch;
+                        return r;
+                }
+        }
+
+        int run;
+        if (numTextRuns < MAX_TEXT_RUNS)
+                run = numTextRuns++;
+        else {
+                run = 0;
+                for (int i = 1; i < numTextRuns; i++)
+                        if (textRuns[i].lastUsedBatch < textRuns[run].lastUsedBatch)
+                                run = i;
+                free_text_run(run);
+        }
+        struct TextRun *r = &textRuns[run];
+        int length = (int) strlen(text);
+        ALLOC_MEMORY(&r->text, length + 1);
+        memcpy(r->text, text, length + 1);
+        ALLOC_MEMORY(&r->glyphs, length > 0 ? length : 1);  // at most one glyph per byte
+        r->hash = hash;
+        r->numGlyphs = 0;
+        r->lastUsedBatch = currentBatch;
+        r->nextInBucket = runBuckets[bucket];
+        runBuckets[bucket] = run;
+
+        int hasKerning = FT_HAS_KERNING(ftFace);
+        unsigned previous = 0;
+        float penX = 0.0f;
+        for (const char *p = text; *p;) {
+                unsigned glyphIndex = FT_Get_Char_Index(ftFace, decode_utf8(&p));
+                if (hasKerning && previous != 0 && glyphIndex != 0) {
+                        FT_Vector delta;
+                        FT_Get_Kerning(ftFace, previous, glyphIndex, FT_KERNING_UNFITTED, &delta);
+                        penX += delta.x / 64.0f;
+                }
+                if (FT_Load_Glyph(ftFace, glyphIndex, FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP) != 0)
+                        continue;
+                r->glyphs[r->numGlyphs].glyphIndex = glyphIndex;
+                r->glyphs[r->numGlyphs].penX = penX;
+                r->numGlyphs++;
+                penX += ftFace->glyph->advance.x / 64.0f;
+                previous = glyphIndex;
+        }
+        r->width = penX;
+        return r;
+}
+
+static int load_font(const char *path)
+{
+        if (FT_New_Face(ftLibrary, path, 0, &ftFace) != 0)
+                return 0;
+        log_postf("Using font %s", path);
+        return 1;
+}
+
+void setup_text(void)
+{
+        if (FT_Init_FreeType(&ftLibrary) != 0) {
+                log_postf("Failed to initialize FreeType. Text is disabled.");
+                return;
+        }
+        const char *envPath = getenv("SHAPES_FONT");
+        int isLoaded = envPath && load_font(envPath);
+        for (int i = 0; i < LENGTH(fontSearchPaths) && !isLoaded; i++)
+                isLoaded = load_font(fontSearchPaths[i]);
+        if (!isLoaded) {
+                log_postf("No font found (set SHAPES_FONT to a font file). Text is disabled.");
+                return;
+        }
+
+        FT_Set_Pixel_Sizes(ftFace, 0, SDF_PIXEL_SIZE);
+        atlasTexture = create_GfxTexture();
+        set_GfxTexture_size(atlasTexture, TEXTUREFORMAT_R8, TEXT_ATLAS_SIZE, TEXT_ATLAS_SIZE);
+        for (int i = 0; i < NUM_GLYPH_BUCKETS; i++)
+                glyphBuckets[i] = -1;
+        for (int i = 0; i < MAX_ATLAS_GLYPHS; i++)
+                atlasGlyphs[i].nextInBucket = i + 1 < MAX_ATLAS_GLYPHS ? i + 1 : -1;
+        firstFreeGlyph = 0;
+        for (int i = 0; i < NUM_RUN_BUCKETS; i++)
+                runBuckets[i] = -1;
+        isTextAvailable = 1;
+
+        // make the printable ASCII glyphs now, in parallel
+        unsigned asciiGlyphs[127 - 32];
+        int numAsciiGlyphs = 0;
+        for (unsigned c = 32; c < 127; c++) {
+                unsigned glyphIndex = FT_Get_Char_Index(ftFace, c);
+                int j = 0;
+                while (j < numAsciiGlyphs && asciiGlyphs[j] != glyphIndex)
+                        j++;  // keep duplicates (like the missing glyph) out
+                if (j == numAsciiGlyphs)
+                        asciiGlyphs[numAsciiGlyphs++] = glyphIndex;
+        }
+        generate_glyphs(asciiGlyphs, numAsciiGlyphs);
+}
+
+int is_text_available(void)
+{
+        return isTextAvailable;
+}
+
+GfxTexture get_text_atlas_texture(void)
+{
+        return atlasTexture;
+}
+
+void begin_text_batch(void)
+{
+        currentBatch++;
+}
+
+int layout_text(const char *text, float fontSize, const struct GlyphQuad **outQuads, float *outWidth)
+{
+        *outQuads = layoutQuads;
+        *outWidth = 0.0f;
+        if (!isTextAvailable)
+                return 0;
+        const struct TextRun *run = get_text_run(text);
+        if (layoutQuadsCapacity < run->numGlyphs) {
+                layoutQuadsCapacity = run->numGlyphs;
+                REALLOC_MEMORY(&layoutQuads, layoutQuadsCapacity);
+                REALLOC_MEMORY(&missingGlyphs, layoutQuadsCapacity);
+        }
+
+        // the glyphs that are not in the atlas get made together
+        int numMissingGlyphs = 0;
+        for (int i = 0; i < run->numGlyphs; i++) {
+                unsigned glyphIndex = run->glyphs[i].glyphIndex;
+                if (find_atlas_glyph(glyphIndex) != NULL)
+                        continue;
+                int j = 0;
+                while (j < numMissingGlyphs && missingGlyphs[j] != glyphIndex)
+                        j++;
+                if (j == numMissingGlyphs)
+                        missingGlyphs[numMissingGlyphs++] = glyphIndex;
+        }
+        if (numMissingGlyphs > 0)
+                generate_glyphs(missingGlyphs, numMissingGlyphs);
+
+        int numQuads = 0;
+        const float scale = fontSize / SDF_PIXEL_SIZE;
+        const float texelSize = 1.0f / TEXT_ATLAS_SIZE;
+        for (int i = 0; i < run->numGlyphs; i++) {
+                const struct AtlasGlyph *glyph = find_atlas_glyph(run->glyphs[i].glyphIndex);
+                if (glyph == NULL || glyph->shelf == -1)
+                        continue;  // doesn't fit, or nothing to draw (like a space)
+                struct GlyphQuad *quad = &layoutQuads[numQuads++];
+                quad->offset[0] = (run->glyphs[i].penX + glyph->originX) * scale;
+                quad->offset[1] = glyph->originY * scale;
+                quad->size[0] = glyph->width * scale;
+                quad->size[1] = glyph->height * scale;
+                // the rows of the distance field are stored from the top down
+                quad->texRect[0] = glyph->x * texelSize;
+                quad->texRect[1] = (glyph->y + glyph->height) * texelSize;
+                quad->texRect[2] = (glyph->x + glyph->width) * texelSize;
+                quad->texRect[3] = glyph->y * texelSize;
+        }
+        *outQuads = layoutQuads;
+        *outWidth = run->width * scale;
+        return numQuads;
+}
@@ -239,6 +239,11 @@ void wait_for_events(void)
         }
         isDoingPolling = 0;
 
+        if (scheduledRedrawTime != 0.0 && glfwGetTime() >= scheduledRedrawTime) {
+                scheduledRedrawTime = 0.0;
+                isRedrawNeeded = 1;
+        }
+
         // for now, also generate a virtual tick event
         {
                 struct Input inp;
@@ -247,6 +252,11 @@ void wait_for_events(void)
         }
 }
 
+double get_time_in_seconds(void)
+{
+        return glfwGetTime();
+}
+
 void swap_buffers(void)
 {
         glfwSwapInterval(1);
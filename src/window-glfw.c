@@ -85,7 +85,11 @@ static const struct {
         { GLFW_RELEASE, KEYEVENT_RELEASE },
 };
 
+/* how long to block for input while we're waiting for the next time tick */
+static const double TIMETICK_INTERVAL_SECONDS = 1.0 / 60.0;
+
 static GLFWwindow *windowGlfw;
+static double lastTimetickTime;
 static int isFullscreenMode;
 static volatile int isDoingPolling;  // needed for a hack. See below
 
@@ -297,7 +301,13 @@ void setup_window(void)
         glfwDefaultWindowHints();
         glfwWindowHint(GLFW_SAMPLES, 4);
         glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);  // 3.3 for instanced attributes
+        // The shaders are written for the core profile (#version 330). macOS
+        // only has 3.2+ contexts as forward compatible core contexts.
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+#ifdef __APPLE__
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GLFW_TRUE);
+#endif
         //glfwWindowHint(GLFW_MAXIMIZED, GLFW_TRUE);
         //glfwWindowHint(GLFW_SCALE_TO_MONITOR, GLFW_TRUE);  // window size dependent on monitor scale
         windowGlfw = glfwCreateWindow(1024, 768, "Astedit", NULL, NULL);
@@ -333,26 +343,50 @@ void teardown_window(void)
 void wait_for_events(void)
 {
         isDoingPolling = 1;
-        // TODO: Use glfwPollEvents() if it's clear that we should produce the next frame immediately
-        if (0) {
-                glfwWaitEvents();
+        // If the next frame should be produced immediately, don't block.
+        // Otherwise sleep until there is input, or until the next tick or
+        // the scheduled redraw, whichever comes first.
+        double timeout = -1.0;
+        if (areTimeticksNeeded)
+                timeout = TIMETICK_INTERVAL_SECONDS;
+        if (scheduledRedrawTime != 0.0) {
+                double untilRedraw = scheduledRedrawTime - glfwGetTime();
+                if (timeout < 0.0 || untilRedraw < timeout)
+                        timeout = untilRedraw;
         }
-        else {
+        if (isRedrawNeeded || (scheduledRedrawTime != 0.0 && timeout <= 0.0))
                 glfwPollEvents();
-        }
+        else if (timeout > 0.0)
+                glfwWaitEventsTimeout(timeout);
+        else
+                glfwWaitEvents();
         isDoingPolling = 0;
 
+        if (scheduledRedrawTime != 0.0 && glfwGetTime() >= scheduledRedrawTime) {
+                scheduledRedrawTime = 0.0;
+                isRedrawNeeded = 1;
+        }
+
         if (glfwWindowShouldClose(windowGlfw))
                 shouldWindowClose = 1;
 
-        // for now, also generate a virtual tick event
-        {
-                struct Input inp;
-                inp.inputKind = INPUT_TIMETICK;
-                enqueue_input(&inp);
+        // We might have been woken up by input before the tick was due
+        if (areTimeticksNeeded) {
+                double now = glfwGetTime();
+                if (now - lastTimetickTime >= TIMETICK_INTERVAL_SECONDS) {
+                        lastTimetickTime = now;
+                        struct Input inp;
+                        inp.inputKind = INPUT_TIMETICK;
+                        enqueue_input(&inp);
+                }
         }
 }
 
+double get_time_in_seconds(void)
+{
+        return glfwGetTime();
+}
+
 void swap_buffers(void)
 {
         glfwSwapInterval(1);
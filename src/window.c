@@ -29,3 +29,10 @@ void consume_input(void)
         inputFront = (inputFront + 1) % LENGTH(inpbuf);
         numInputs--;
 }
+
+/* The earliest scheduled redraw wins */
+void schedule_redraw(double time)
+{
+        if (scheduledRedrawTime == 0.0 || time < scheduledRedrawTime)
+                scheduledRedrawTime = time;
+}
@@ -0,0 +1,234 @@
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define _GNU_SOURCE  // sysconf(_SC_NPROCESSORS_ONLN)
+#endif
+#include <shapes/defs.h>
+#include <shapes/logging.h>
+#include <shapes/workers.h>
+#if defined(__EMSCRIPTEN__)
+#define WORKERS_SERIAL
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+enum {
+        MAX_WORKER_THREADS = 64,
+};
+
+#ifndef WORKERS_SERIAL
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Condvar;
+static void init_mutex(Mutex *m) { InitializeCriticalSection(m); }
+static void lock_mutex(Mutex *m) { EnterCriticalSection(m); }
+static void unlock_mutex(Mutex *m) { LeaveCriticalSection(m); }
+static void init_condvar(Condvar *c) { InitializeConditionVariable(c); }
+static void wait_condvar(Condvar *c, Mutex *m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void broadcast_condvar(Condvar *c) { WakeAllConditionVariable(c); }
+static void signal_condvar(Condvar *c) { WakeConditionVariable(c); }
+#else
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Condvar;
+static void init_mutex(Mutex *m) { pthread_mutex_init(m, NULL); }
+static void lock_mutex(Mutex *m) { pthread_mutex_lock(m); }
+static void unlock_mutex(Mutex *m) { pthread_mutex_unlock(m); }
+static void init_condvar(Condvar *c) { pthread_cond_init(c, NULL); }
+static void wait_condvar(Condvar *c, Mutex *m) { pthread_cond_wait(c, m); }
+static void broadcast_condvar(Condvar *c) { pthread_cond_broadcast(c); }
+static void signal_condvar(Condvar *c) { pthread_cond_signal(c); }
+#endif
+
+static Mutex workMutex;
+static Condvar workAvailableCondvar;
+static Condvar workDoneCondvar;
+
+/* The current task. Protected by workMutex */
+static WORKER_FUNCTION *taskFunc;
+static void *taskArg;
+static int taskNumJobs;
+static int taskNextJob;
+static int taskNumJobsDone;
+
+/* The background job. Protected by workMutex */
+static WORKER_FUNCTION *backgroundFunc;
+static void *backgroundArg;
+static int isBackgroundJobPending;  // not yet picked up by a worker
+static int isBackgroundJobRunning;
+
+/* Claim and run jobs of the current task until there are none left. Must be
+ * called with workMutex held. Returns with workMutex held. */
+static void work_on_current_task(void)
+{
+        while (taskNextJob < taskNumJobs) {
+                int jobIndex = taskNextJob++;
+                WORKER_FUNCTION *func = taskFunc;
+                void *arg = taskArg;
+                int numJobs = taskNumJobs;
+                unlock_mutex(&workMutex);
+                func(arg, jobIndex, numJobs);
+                lock_mutex(&workMutex);
+                taskNumJobsDone++;
+                if (taskNumJobsDone == taskNumJobs)
+                        signal_condvar(&workDoneCondvar);
+        }
+}
+
+/* Jobs of the current task come first. The worker that picks up the
+ * background job is busy until it's done, run_parallel() just gets one
+ * helper less in the meantime. */
+static void worker_loop(void)
+{
+        lock_mutex(&workMutex);
+        for (;;) {
+                while (taskNextJob >= taskNumJobs && !isBackgroundJobPending)
+                        wait_condvar(&workAvailableCondvar, &workMutex);
+                if (taskNextJob < taskNumJobs)
+                        work_on_current_task();
+                else {
+                        isBackgroundJobPending = 0;
+                        isBackgroundJobRunning = 1;
+                        WORKER_FUNCTION *func = backgroundFunc;
+                        void *arg = backgroundArg;
+                        unlock_mutex(&workMutex);
+                        func(arg, 0, 1);
+                        lock_mutex(&workMutex);
+                        isBackgroundJobRunning = 0;
+                }
+        }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_thread_proc(LPVOID param)
+{
+        UNUSED(param);
+        worker_loop();
+        return 0;
+}
+#else
+static void *worker_thread_proc(void *param)
+{
+        UNUSED(param);
+        worker_loop();
+        return NULL;
+}
+#endif
+
+static int get_number_of_cpus(void)
+{
+#ifdef _WIN32
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        return (int) systemInfo.dwNumberOfProcessors;
+#else
+        return (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+void setup_workers(void)
+{
+        init_mutex(&workMutex);
+        init_condvar(&workAvailableCondvar);
+        init_condvar(&workDoneCondvar);
+
+        int numCpus = get_number_of_cpus();
+        if (numCpus < 1)
+                numCpus = 1;
+        if (numCpus > MAX_WORKER_THREADS)
+                numCpus = MAX_WORKER_THREADS;
+
+        // the thread calling run_parallel() is a worker, too
+        numWorkerThreads = 1;
+        for (int i = 1; i < numCpus; i++) {
+#ifdef _WIN32
+                HANDLE thread = CreateThread(NULL, 0, &worker_thread_proc, NULL, 0, NULL);
+                if (thread == NULL) {
+                        log_postf("Failed to create worker thread");
+                        break;
+                }
+                CloseHandle(thread);
+#else
+                pthread_t thread;
+                if (pthread_create(&thread, NULL, &worker_thread_proc, NULL) != 0) {
+                        log_postf("Failed to create worker thread");
+                        break;
+                }
+                pthread_detach(thread);
+#endif
+                numWorkerThreads++;
+        }
+}
+
+void run_parallel(WORKER_FUNCTION *func, void *arg, int numJobs)
+{
+        if (numWorkerThreads <= 1 || numJobs <= 1) {
+                for (int i = 0; i < numJobs; i++)
+                        func(arg, i, numJobs);
+                return;
+        }
+        lock_mutex(&workMutex);
+        ENSURE(taskNextJob >= taskNumJobs);  // run_parallel() is not reentrant
+        taskFunc = func;
+        taskArg = arg;
+        taskNumJobs = numJobs;
+        taskNextJob = 0;
+        taskNumJobsDone = 0;
+        broadcast_condvar(&workAvailableCondvar);
+        work_on_current_task();
+        while (taskNumJobsDone < taskNumJobs)
+                wait_condvar(&workDoneCondvar, &workMutex);
+        unlock_mutex(&workMutex);
+}
+
+void start_background_job(WORKER_FUNCTION *func, void *arg)
+{
+        if (numWorkerThreads <= 1) {
+                func(arg, 0, 1);
+                return;
+        }
+        lock_mutex(&workMutex);
+        ENSURE(!isBackgroundJobPending && !isBackgroundJobRunning);
+        backgroundFunc = func;
+        backgroundArg = arg;
+        isBackgroundJobPending = 1;
+        signal_condvar(&workAvailableCondvar);
+        unlock_mutex(&workMutex);
+}
+
+int is_background_job_done(void)
+{
+        if (numWorkerThreads <= 1)
+                return 1;
+        lock_mutex(&workMutex);
+        int isDone = !isBackgroundJobPending && !isBackgroundJobRunning;
+        unlock_mutex(&workMutex);
+        return isDone;
+}
+
+#else  // WORKERS_SERIAL
+
+void setup_workers(void)
+{
+        numWorkerThreads = 1;
+}
+
+void run_parallel(WORKER_FUNCTION *func, void *arg, int numJobs)
+{
+        for (int i = 0; i < numJobs; i++)
+                func(arg, i, numJobs);
+}
+
+void start_background_job(WORKER_FUNCTION *func, void *arg)
+{
+        func(arg, 0, 1);
+}
+
+int is_background_job_done(void)
+{
+        return 1;
+}
+
+#endif